@@ -0,0 +1,135 @@
+#ifndef CHUNK_TRANSFER_H_
+#define CHUNK_TRANSFER_H_
+
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// Large payloads are cut into fixed-size chunks, each with its own checksum,
+// so a lossy link only resends the pieces that were lost.  The epoch is
+// drawn when the sender starts, so ids reused after a restart are told apart.
+// kind tells the receiver what the payload holds
+struct Chunk {
+  uint32_t epoch;
+  uint8_t kind;
+  uint32_t payload_id;
+  uint32_t index;
+  uint32_t num_chunks;
+  uint32_t payload_size;
+  uint32_t offset;
+  // CRC-32 of the whole payload, and of this chunk's other fields and data
+  uint32_t payload_crc;
+  uint32_t crc;
+  std::vector<uint8_t> data;
+};
+
+// CRC-32 of data, continuing from the CRC of what came before it
+uint32_t crc32(const uint8_t *data, size_t size, uint32_t crc = 0);
+uint32_t chunkCrc(const Chunk& chunk);
+
+// Keeps the last max_payloads payloads so gaps can be resent on request
+class ChunkSender {
+  public:
+    ChunkSender(size_t chunk_size, size_t max_payloads);
+
+    uint32_t epoch() const { return sender_epoch; }
+    // Store a payload and return its id.  Ids are consecutive, so a
+    // receiver can tell from a later payload that one was lost whole
+    uint32_t add(const std::vector<uint8_t>& payload, uint8_t kind = 0);
+    uint32_t numChunks(uint32_t id) const;
+    // False if the payload was released or the index is out of range
+    bool chunk(uint32_t id, uint32_t index, Chunk& out) const;
+
+  private:
+    struct Payload {
+      uint8_t kind;
+      uint32_t crc;
+      std::vector<uint8_t> data;
+    };
+
+    size_t chunk_size;
+    size_t max_payloads;
+    uint32_t sender_epoch;
+    uint32_t next_id;
+    std::map<uint32_t, Payload> payloads;
+};
+
+// Receiver side reassembly buffer, one partial payload per (owner, epoch, id)
+class ChunkReassembler {
+  public:
+    typedef std::tuple<std::string, uint32_t, uint32_t> PayloadKey;
+
+    // Missing chunks of one payload, as inclusive index ranges
+    struct Gaps {
+      std::string owner;
+      uint32_t epoch;
+      uint32_t payload_id;
+      std::vector<std::pair<uint32_t, uint32_t>> ranges;
+    };
+
+    // At most max_payloads partial payloads of max_bytes together are kept
+    ChunkReassembler(size_t max_payloads, size_t max_bytes);
+
+    // Store a chunk.  Returns true and fills payload when it completes one.
+    // Chunks that fail their checksum, or announce a payload larger than
+    // max_bytes, are dropped and show up as gaps.  A payload that fails its
+    // own checksum once complete is requested again whole.  Ids skipped
+    // by an owner's epoch are kept as payloads of unknown size, so one
+    // whose chunks were all lost is requested too
+    bool add(const std::string& owner, const Chunk& chunk, double now,
+             std::vector<uint8_t>& payload);
+
+    // Gaps of payloads that got no chunk for timeout seconds.  Each payload
+    // is reported again only after another timeout.  A payload of unknown
+    // size is asked for whole, as the range 0 to UINT32_MAX, and given up
+    // if that goes unanswered.  So are payloads of an owner's earlier
+    // epochs, which it can no longer resend
+    void missing(double now, double timeout, std::vector<Gaps>& gaps);
+
+    size_t numPartial() const { return partials.size(); }
+    size_t bufferedBytes() const { return buffered; }
+
+  private:
+    struct Partial {
+      // 0 until a chunk of a skipped payload arrives
+      uint32_t num_chunks;
+      uint8_t kind;
+      uint32_t payload_crc;
+      uint32_t num_have;
+      std::vector<uint8_t> data;
+      std::vector<bool> have;
+      double last_update;
+      bool requested;
+    };
+
+    size_t max_payloads;
+    size_t max_bytes;
+    size_t buffered;
+    std::map<PayloadKey, Partial> partials;
+    // Latest epoch of each owner and the id after the newest one seen in it
+    std::map<std::string, std::pair<uint32_t, uint32_t>> next_ids;
+    // Recently completed payloads, so late resends are ignored
+    std::set<PayloadKey> completed;
+    std::deque<PayloadKey> completed_order;
+};
+
+// Stand-in for a lossy mesh link: drops each chunk with probability loss_rate
+class LossyLink {
+  public:
+    LossyLink(double loss_rate, unsigned int seed = std::random_device()())
+      : loss_rate(loss_rate), rng(seed), uniform(0, 1) {}
+    bool drop() { return loss_rate > 0 && uniform(rng) < loss_rate; }
+
+  private:
+    double loss_rate;
+    std::mt19937 rng;
+    std::uniform_real_distribution<double> uniform;
+};
+
+#endif
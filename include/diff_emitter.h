@@ -0,0 +1,42 @@
+#ifndef DIFF_EMITTER_H_
+#define DIFF_EMITTER_H_
+
+#include <algorithm>
+
+// Decides when the robot's accumulated changes become a diff, and paces
+// publishing of emitted diffs with a token bucket so the link budget holds
+class DiffEmitter {
+  public:
+    // min_volume: changed volume (m^3) that is worth a diff on its own
+    // max_interval: seconds after which any pending change is sent anyway
+    // bandwidth: bytes/s refilled into the bucket (<= 0 = unlimited)
+    // burst: bucket size in bytes
+    DiffEmitter(double min_volume, double max_interval, double bandwidth, double burst);
+
+    bool ready(double changed_volume, double now) const;
+    void emitted(double now) { last_emit = now; }
+
+    // Take bytes from the bucket.  A full bucket always lets one diff through,
+    // so diffs larger than the burst size are not held back forever; the
+    // debt it leaves is capped at one burst
+    bool consume(double bytes, double now);
+
+    // Receiver load reported over the backpressure topic (1 = keeping up).
+    // Above 1, diffs need that much more change and the link budget shrinks
+    // by the same factor
+    void setLoad(double l) { load = std::max(l, 1.0); }
+
+  private:
+    double min_volume;
+    double max_interval;
+    double bandwidth;
+    double burst;
+    double tokens;
+    double last_refill;
+    double last_emit;
+    double load;
+
+    void refill(double now);
+};
+
+#endif
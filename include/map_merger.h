@@ -0,0 +1,40 @@
+#ifndef MAP_MERGER_H_
+#define MAP_MERGER_H_
+
+#include <octomap/octomap.h>
+#include <stdint.h>
+#include <vector>
+#include "octree_owned.h"
+
+using namespace octomap;
+
+// Diffing and merging of octrees, free of ROS so they can be tested alone
+
+double build_diff_tree(OcTreeOwned *tree1, OcTree *tree2, OcTreeOwned *tree_diff,
+                       double thresh = 0, double *num_changed = NULL);
+// Split a pruned diff into chunks for progressive sending: occupied voxels
+// and coarse free blocks first, finer free space after
+void split_diff(OcTreeOwned *diff, std::vector<OcTreeOwned*>& chunks,
+                unsigned int coarse_depth, size_t max_leaves);
+template <class TREE>
+void merge_maps(OcTreeOwned *tree1, TREE *tree2, bool replace, bool overwrite,
+                uint8_t owner = 0);
+// Same for the subtree of tree2 under node, whose key and depth are given
+template <class TREE>
+void merge_subtree(OcTreeOwned *tree1, TREE *tree2, const typename TREE::NodeType *node,
+                   const OcTreeKey& key, unsigned int depth, bool replace, bool overwrite,
+                   uint8_t owner = 0);
+// Neighbor merge (replace = false) of a decoded diff that grafts its
+// subtrees at depth into absent regions of tree1 and merges the rest.
+// tree2 is taken apart and can only be deleted afterwards
+void graft_diff(OcTreeOwned *tree1, OcTree *tree2, unsigned int depth, bool overwrite,
+                uint8_t owner);
+// Stamped diffs, for merging many at once: each voxel's own flag holds the
+// overwrite flag of the diff it came from.  combine_stamped folds a later
+// one into an earlier one, so that merging the result equals merging both in
+// order.  merge_stamped merges the subtree under node with those flags
+void combine_stamped(OcTreeOwned *earlier, OcTreeOwned *later);
+void merge_stamped(OcTreeOwned *tree1, OcTreeOwned *stamped, const OcTreeNodeOwned *node,
+                   const OcTreeKey& key, unsigned int depth);
+
+#endif
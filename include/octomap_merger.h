@@ -2,7 +2,9 @@
 #define OCTOMAP_MERGER_H_
 
 #include <Eigen/SVD>
+#include <Eigen/Geometry>
 #include <ros/ros.h>
+#include <ros/callback_queue.h>
 #include <pcl/common/common.h>
 #include <pcl/io/pcd_io.h>
 #include <pcl/filters/voxel_grid.h>
@@ -13,19 +15,48 @@
 #include <pcl/registration/transforms.h>
 #include <pcl_conversions/pcl_conversions.h>
 #include <sensor_msgs/PointCloud2.h>
+#include <nav_msgs/Odometry.h>
 #include <octomap/octomap.h>
-#include <octomap/OcTreeStamped.h>
 #include <octomap_msgs/Octomap.h>
 #include <octomap_msgs/conversions.h>
 #include <std_msgs/UInt32.h>
+#include <std_msgs/String.h>
+#include <std_msgs/Float32.h>
 #include <fstream>
+#include <sstream>
 #include <iostream>
 #include <string.h>
 #include <stdlib.h>
 #include <list>
+#include <deque>
+#include <set>
+#include <tuple>
 #include <cmath>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "octree_owned.h"
+#include "map_merger.h"
+#include "provenance_layers.h"
+#include "subtree_dag.h"
+#include "tile_store.h"
+#include "diff_emitter.h"
+#include "chunk_transfer.h"
+#include "work_pool.h"
 #include "marble_octomap_merger/OctomapArray.h"
 #include "marble_octomap_merger/OctomapNeighbors.h"
+#include "marble_octomap_merger/OctomapPage.h"
+#include "marble_octomap_merger/OctomapPages.h"
+#include "marble_octomap_merger/PageRequest.h"
+#include "marble_octomap_merger/AnchorUpdate.h"
+#include "marble_octomap_merger/OctomapDag.h"
+#include "marble_octomap_merger/PayloadChunk.h"
+#include "marble_octomap_merger/MissingChunks.h"
+#include "marble_octomap_merger/DiffAck.h"
+#include "marble_octomap_merger/DiffSummary.h"
 
 using std::cout;
 using std::endl;
@@ -56,6 +87,15 @@ void tree2PointCloud(T *tree, pcl::PointCloud<pcl::PointXYZ>& pclCloud) {
   }
 }
 
+template <typename T>
+void treeBBX(T *tree, point3d& min, point3d& max) {
+  double x, y, z;
+  tree->getMetricMin(x, y, z);
+  min = point3d(x, y, z);
+  tree->getMetricMax(x, y, z);
+  max = point3d(x, y, z);
+}
+
 bool pointInBBox(pcl::PointXYZ& point,
                  pcl::PointXYZ& bboxMin,
                  pcl::PointXYZ& bboxMax);
@@ -70,9 +110,19 @@ void transformTree(OcTree *tree, Eigen::Matrix4f& transform);
 
 void align_maps(OcTree *tree1, OcTree *tree2, point3d translation,
                 double roll, double pitch, double yaw, double res);
+void anchorTree(OcTree *tree, const Pose6D& anchor);
 
-double build_diff_tree(OcTree *tree1, OcTree *tree2, OcTree *tree_diff);
-void merge_maps(OcTreeStamped *tree1, OcTree *tree2, bool replace, bool overwrite);
+// How a diff relates to the merged map, from its summary alone
+enum Overlap { OVERLAP_MIXED, OVERLAP_INSERT, OVERLAP_DUPLICATE };
+// Bounding box and the cells a diff touches down to depth, with their
+// log-odds where the diff is uniform over them, as decoded from a binary
+// message if binary is set
+void summarize_diff(OcTreeOwned *diff, unsigned int depth, bool binary,
+                    marble_octomap_merger::DiffSummary& summary);
+// Classify a summarized diff against the merged map and the cells of the
+// earlier diffs of its batch (footprint), then add its cells to footprint
+Overlap classify_diff(OcTreeOwned *merged, OcTreeOwned *footprint,
+                      const marble_octomap_merger::DiffSummary& summary, bool check_merged);
 
 class OctomapMerger {
   public:
@@ -82,9 +132,23 @@ class OctomapMerger {
     ~OctomapMerger();
     // Callbacks
     void callback_myMap(const octomap_msgs::Octomap::ConstPtr& msg);
-    void callback_neighborMaps(const marble_octomap_merger::OctomapNeighborsConstPtr &msg);
+    void callback_neighborMaps(const marble_octomap_merger::OctomapPagesConstPtr &msg);
+    void callback_legacyNeighborMaps(const marble_octomap_merger::OctomapNeighborsConstPtr &msg);
+    void callback_dropOwner(const std_msgs::String::ConstPtr& msg);
+    void callback_anchor(const marble_octomap_merger::AnchorUpdateConstPtr& msg);
+    void callback_odom(const nav_msgs::Odometry::ConstPtr& msg);
+    void callback_chunk(const marble_octomap_merger::PayloadChunkConstPtr& msg);
+    void callback_missingChunks(const marble_octomap_merger::MissingChunksConstPtr& msg);
+    void callback_diffAck(const marble_octomap_merger::DiffAckConstPtr& msg);
+    void callback_backpressure(const std_msgs::Float32::ConstPtr& msg);
+    void callback_pageRequest(const marble_octomap_merger::PageRequestConstPtr& msg);
     // Public Methods
-    void merge();
+    // Own-map stage: decode, diff, merge and emit our diffs
+    void mergeOwn();
+    void publishDiffs(double now);
+    void splitPendingDiff();
+    void requestMissingChunks(double now);
+    void requestPages(double now);
     void combine_diffs();
     // Variables
     bool myMapNew;
@@ -96,39 +160,273 @@ class OctomapMerger {
     bool free_prioritize;
     int octo_type;
     double resolution;
-    int map_thresh;
+    double diff_min_volume;
+    double diff_max_interval;
+    double diff_bandwidth;
+    double diff_burst;
+    bool diff_coalesce;
+    int diff_page_size;
+    double page_request_timeout;
+    int dedup_window;
+    int neighbor_queue_size;
+    double rate;
+    double neighbor_rate;
+    int neighbor_batch;
+    int neighbor_nice;
+    int merge_threads;
+    std::string merge_affinity;
+    int merge_task_depth;
+    int merge_task_bytes;
+    int stripe_depth;
+    int merge_stripes;
+    int bootstrap_batch;
+    int summary_depth;
+    double backpressure_timeout;
+    bool legacy_schema;
+    bool diff_progressive;
+    int chunk_coarse_depth;
+    int chunk_max_leaves;
+    double diff_thresh;
+    bool provenance_layers;
+    int reanchor_budget;
+    bool dag_snapshots;
+    double memory_budget;
+    int coarsen_depth;
+    double coarsen_radius;
+    bool out_of_core;
+    int tile_depth;
+    double tile_evict_age;
+    int max_resident_tiles;
+    std::string tile_store_path;
+    bool chunked_transfer;
+    int transfer_chunk_size;
+    int transfer_max_buffer;
+    double transfer_timeout;
+    double transfer_loss_rate;
+    bool diff_acks;
+    std::string diff_ack_peers;
+    std::string diff_archive_path;
     std::string map_topic;
     std::string neighbors_topic;
     std::string merged_topic;
     std::string map_diffs_topic;
+    std::string neighbor_pages_topic;
+    std::string map_diff_pages_topic;
+    std::string page_requests_topic;
     std::string num_diffs_topic;
     std::string pcl_topic;
+    std::string drop_owner_topic;
+    std::string anchor_topic;
+    std::string dag_topic;
+    std::string odom_topic;
+    std::string chunks_topic;
+    std::string neighbor_chunks_topic;
+    std::string missing_chunks_topic;
+    std::string neighbor_dags_topic;
+    std::string neighbor_merged_topic;
+    std::string diff_acks_topic;
+    std::string neighbor_acks_topic;
+    std::string backpressure_topic;
+    std::string neighbor_backpressure_topic;
 
   /* Private Variables and Methods */
   private:
     ros::NodeHandle nh_;
 
-    octomap_msgs::Octomap myMap;
-    marble_octomap_merger::OctomapArray mapdiffs;
-    marble_octomap_merger::OctomapNeighbors neighbors;
-    octomap::OcTreeStamped *tree_merged;
+    // Newest own map; older ones are dropped by the subscriber unread
+    octomap_msgs::OctomapConstPtr myMap;
+    // Our diffs still held
+    marble_octomap_merger::OctomapPage mapdiffs;
+
+    // Diffs received from one neighbor, by seq.  mergeNeighbors() only looks
+    // at the ones from cursor on; a late diff below it moves the cursor back
+    struct NeighborBuffer {
+      NeighborBuffer() : paged(false), seq_oldest(0), seq_end(0), cursor(0), continuation(0),
+                         requested(0), request_time(0) {}
+      std::map<uint32_t, octomap_msgs::Octomap> diffs;
+      std::map<uint32_t, uint32_t> hashes;
+      std::map<uint32_t, marble_octomap_merger::DiffSummary> summaries;
+      std::set<uint32_t> merged;
+      // The owner sends pages, so it reports seq_oldest and answers requests
+      bool paged;
+      uint32_t seq_oldest;
+      // One past the newest seq the owner has reported
+      uint32_t seq_end;
+      uint32_t cursor;
+      // Seq the last page received continues at, 0 if none; and the seq
+      // last asked of the owner, and when
+      uint32_t continuation;
+      uint32_t requested;
+      double request_time;
+    };
+    std::map<std::string, NeighborBuffer> neighbors;
+    // Neighbor whose diff was last put in a batch
+    std::string last_served;
+    // Newest copy of each neighbor page not yet ingested, by (owner, first seq, last seq)
+    typedef std::tuple<std::string, uint32_t, uint32_t> PageKey;
+    std::map<PageKey, marble_octomap_merger::OctomapPageConstPtr> pending_pages;
+    // Highest load reported by a peer lately, and when
+    double peer_load;
+    double peer_load_time;
+    // (owner, seq, content hash) of recently ingested diffs, oldest first
+    typedef std::tuple<std::string, uint32_t, uint32_t> SeenKey;
+    std::set<SeenKey> recently_seen;
+    std::deque<SeenKey> seen_order;
+    octomap::OcTreeOwned *tree_merged;
     octomap::OcTree *tree_sys;
-    octomap::OcTree *tree_old;
-    octomap::OcTree *tree_temp;
-    octomap::OcTree *tree_diff;
+    octomap::OcTreeOwned *tree_old;
+    octomap::OcTreeOwned *tree_diff;
+    // Own diffs not yet in tree_merged because the neighbor worker held it
+    octomap::OcTreeOwned *own_backlog;
+    // Box around everything ever written to tree_merged; it only grows
+    point3d merged_min;
+    point3d merged_max;
+    bool have_merged_bbx;
+
+    // tree_merged, layers and tiles are shared by both stages; own_backlog,
+    // the published diffs and the chunk sender each have their own lock
+    std::mutex merged_mutex;
+    std::mutex backlog_mutex;
+    std::mutex diffs_mutex;
+    std::mutex transfer_mutex;
+    std::atomic<bool> merged_changed;
+
+    // Neighbor worker, with the callback queue of every non-own subscription
+    ros::CallbackQueue neighbor_queue;
+    std::thread neighbor_worker;
+    std::atomic<bool> stop_worker;
+    // Decodes and merges the neighbor worker's batches
+    WorkPool *pool;
+
+    // One neighbor diff of the batch being merged
+    struct BatchDiff {
+      std::string owner;
+      uint8_t owner_id;
+      const octomap_msgs::Octomap *msg;
+      // NULL if the owner sent none
+      const marble_octomap_merger::DiffSummary *summary;
+      Pose6D anchor;
+      bool overwrite;
+      Overlap overlap;
+      octomap::OcTree *tree;
+    };
+    // What one batch diff holds inside one task region: a subtree of the
+    // decoded diff, or a part of a leaf coarser than the region
+    struct RegionPiece {
+      size_t diff;
+      octomap::OcTreeNode *node;
+      float log_odds;
+    };
     int num_diffs;
-    std::map<std::string, std::vector<int>> seqs;
+    DiffEmitter *emitter;
+    // Emitted diffs waiting for the link, each possibly several coalesced
+    struct PendingDiff {
+      octomap::OcTreeOwned *tree;
+      // Part of a diff split for progressive sending, no longer coalesced into
+      bool chunk;
+      // Emitted diffs it covers
+      uint32_t emit_first;
+      uint32_t emit_last;
+      // Serialized and summarized on first publish attempt, cleared when
+      // more is coalesced
+      octomap_msgs::Octomap msg;
+      marble_octomap_merger::DiffSummary summary;
+    };
+    std::deque<PendingDiff> pending_diffs;
+    // Diffs emitted so far; coalescing and chunking only change how many
+    // messages carry them
+    uint32_t num_emitted;
+    // Seqs peers asked pages of our history from, served by publishDiffs()
+    std::set<uint32_t> page_requests;
+    // The original schema array is behind: diffs were sent or trimmed since
+    // it was last published
+    bool array_stale;
+    std::map<std::string, uint8_t> owner_ids;
+    ProvenanceLayers *layers;
+
+    // Anchor transforms for ranges of an owner's diffs, and the one each merged diff used
+    struct AnchorRange {
+      uint32_t seq_start;
+      uint32_t seq_end;
+      Pose6D anchor;
+    };
+    std::map<std::string, std::vector<AnchorRange>> anchors;
+    std::map<std::string, std::map<uint32_t, Pose6D>> applied_anchors;
+    // Stamp each merged diff got in its owner's provenance layer, by seq
+    std::map<std::string, std::map<uint32_t, unsigned int>> layer_stamps;
+    std::deque<std::pair<std::string, uint32_t>> reanchor_queue;
+
+    TileCache *tiles;
+
+    point3d position;
+    bool have_position;
+
+    ChunkSender *chunk_sender;
+    ChunkReassembler *reassembler;
+    LossyLink *lossy_link;
+
+    // Latest acknowledgement from each peer: owner -> received watermark
+    struct PeerAck {
+      bool base;
+      std::map<std::string, uint32_t> watermarks;
+    };
+    std::map<std::string, PeerAck> peer_acks;
+    std::set<std::string> ack_peers;
 
     ros::Subscriber sub_mymap;
     ros::Subscriber sub_neighbors;
+    ros::Subscriber sub_neighbor_pages;
+    ros::Subscriber sub_page_requests;
+    ros::Subscriber sub_drop;
+    ros::Subscriber sub_anchor;
+    ros::Subscriber sub_odom;
+    ros::Subscriber sub_chunks;
+    ros::Subscriber sub_missing;
+    ros::Subscriber sub_acks;
+    ros::Subscriber sub_backpressure;
 
     ros::Publisher pub_merged;
     ros::Publisher pub_size;
     ros::Publisher pub_mapdiffs;
+    ros::Publisher pub_diff_pages;
+    ros::Publisher pub_page_requests;
     ros::Publisher pub_pcl;
+    ros::Publisher pub_dag;
+    ros::Publisher pub_chunks;
+    ros::Publisher pub_missing;
+    ros::Publisher pub_neighbor_dags;
+    ros::Publisher pub_neighbor_merged;
+    ros::Publisher pub_acks;
+    ros::Publisher pub_backpressure;
 
     void initializeSubscribers();
     void initializePublishers();
+    uint8_t ownerId(const std::string& owner);
+    octomap::OcTree* msgToMap(const octomap_msgs::Octomap& msg);
+    const octomap_msgs::Octomap* findDiff(const std::string& owner, uint32_t seq);
+    Pose6D anchorFor(const std::string& owner, uint32_t seq);
+    void reanchorDiff(const std::string& owner, uint32_t seq);
+    // Remove a merged diff about to be replaced from its owner's layer
+    void unmergeDiff(const std::string& owner, uint32_t seq);
+    void eraseLayered(const std::string& owner, uint32_t seq, octomap::OcTree *diff);
+    void enforceMemoryBudget();
+    template <class MSG>
+    void sendPayload(const MSG& msg, uint8_t kind);
+    void sendChunk(uint32_t payload_id, uint32_t index);
+    void publishAck();
+    void neighborLoop();
+    void mergeNeighbors();
+    void classifyBatch(std::vector<BatchDiff>& batch);
+    void mergeBatch(std::vector<BatchDiff>& batch);
+    void reduceBatch(std::vector<BatchDiff>& batch);
+    void publishMerged();
+    void flushOwnBacklog();
+    void growMergedBBX(const point3d& min, const point3d& max);
+    bool publishPage(size_t first, size_t last, bool charge, double now);
+    void publishArray();
+    void addNeighborPage(const marble_octomap_merger::OctomapPage& page);
+    void queueNeighborPage(const marble_octomap_merger::OctomapPageConstPtr& page);
+    void trimDiffs();
 };
 
 #endif
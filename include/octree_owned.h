@@ -0,0 +1,202 @@
+#ifndef OCTREE_OWNED_H_
+#define OCTREE_OWNED_H_
+
+#include <octomap/OcTree.h>
+#include <octomap/OcTreeNode.h>
+#include <octomap/OcTreeStamped.h>
+#include <octomap/OccupancyOcTreeBase.h>
+#include <stdint.h>
+#include <mutex>
+#include <vector>
+
+namespace octomap {
+
+// Node for the merged map.  Replaces OcTreeNodeStamped, whose 32 bit timestamp
+// only ever held 0 or 1, with a 16 bit word packing the "own" flag (the node
+// came from this agent's map) and a small id of the agent that wrote it.
+// Log-odds stay a float since octomap's occupancy queries take an OcTreeNode.
+// The node is no smaller than OcTreeNodeStamped: the 8 byte children pointer
+// pads both to 16 bytes, the owner word only fits in that padding, and
+// narrower log-odds would not change it.
+class OcTreeNodeOwned : public OcTreeNode {
+  public:
+    enum { OWN_FLAG = 0x8000, OWNER_MASK = 0x00ff };
+
+    OcTreeNodeOwned() : OcTreeNode(), owner(0) {}
+
+    OcTreeNodeOwned(const OcTreeNodeOwned& rhs) : OcTreeNode(rhs), owner(rhs.owner) {}
+
+    // Only the own flag takes part in pruning, as the timestamp did before
+    bool operator==(const OcTreeNodeOwned& rhs) const {
+      return (rhs.value == value && rhs.isOwn() == isOwn());
+    }
+
+    void copyData(const OcTreeNodeOwned& from) {
+      OcTreeNode::copyData(from);
+      owner = from.owner;
+    }
+
+    inline bool isOwn() const { return (owner & OWN_FLAG) != 0; }
+    inline void setOwn(bool own) {
+      owner = own ? (owner | OWN_FLAG) : (owner & ~OWN_FLAG);
+    }
+
+    inline uint8_t getOwnerId() const { return owner & OWNER_MASK; }
+    inline void setOwner(uint8_t id, bool own) {
+      owner = id | (own ? OWN_FLAG : 0);
+    }
+
+    // Inner nodes are marked own if any child is, so an expanded block
+    // never becomes overwritable by a neighbor
+    inline void updateOccupancyChildren() {
+      this->setLogOdds(this->getMaxChildLogOdds());
+      bool own = false;
+      if (children != NULL) {
+        for (unsigned int i = 0; i < 8; i++) {
+          if (children[i] != NULL && static_cast<OcTreeNodeOwned*>(children[i])->isOwn()) {
+            own = true;
+            break;
+          }
+        }
+      }
+      setOwn(own);
+    }
+
+    // Free the child pointer array once every child has been deleted
+    inline void releaseChildren() {
+      delete[] children;
+      children = NULL;
+    }
+
+    // Hang a new child in slot i, allocating the slots if needed.  For
+    // OcTreeOwned's writers, which keep their own node count
+    inline void setChild(unsigned int i, OcTreeNodeOwned *child) {
+      if (children == NULL) {
+        children = new AbstractOcTreeNode*[8];
+        for (unsigned int k = 0; k < 8; k++) children[k] = NULL;
+      }
+      children[i] = child;
+    }
+
+    // Take over a slot array whose entries already point to owned nodes
+    inline void adoptChildren(AbstractOcTreeNode **slots) {
+      delete[] children;
+      children = slots;
+    }
+
+  protected:
+    uint16_t owner;
+};
+
+static_assert(sizeof(OcTreeNodeOwned) <= sizeof(OcTreeNodeStamped),
+              "the owner word should fit in OcTreeNode's padding");
+
+// Merged map tree.  Serialization (binary and full) writes only log-odds, so
+// the stream is byte for byte a standard OcTree and is labelled as one.
+class OcTreeOwned : public OccupancyOcTreeBase<OcTreeNodeOwned> {
+  public:
+    OcTreeOwned(double resolution);
+    ~OcTreeOwned();
+
+    OcTreeOwned* create() const { return new OcTreeOwned(resolution); }
+
+    std::string getTreeType() const { return "OcTree"; }
+
+    // Set a node at the given depth (0 = root, tree_depth = leaf), expanding
+    // pruned ancestors on the way down and dropping any finer structure below
+    OcTreeNodeOwned* setNodeValueAtDepth(const OcTreeKey& key, unsigned int depth,
+                                         float log_odds, bool lazy_eval = false);
+
+    // Merge one source node (possibly a pruned block at depth < tree_depth)
+    // using the merger's rules: replace always writes, overwrite only writes
+    // over nodes that are not our own, absent voxels are always added.  The
+    // block is set as one node where the target is absent or uniform, and
+    // only pushed down where the target has finer structure.  Ancestors are
+    // left for pruneDirty()
+    void mergeNode(const OcTreeKey& key, unsigned int depth, float log_odds,
+                   bool replace, bool overwrite, uint8_t owner);
+
+    // Put the subtree of source under node where this tree has nothing at
+    // key/depth, converted in one pass and stamped with owner and own, in
+    // place of merging it leaf by leaf.  move hands the source's child slot
+    // arrays over and frees its nodes as it goes, leaving node a leaf; the
+    // source can then only be deleted.  Returns false, changing nothing, if
+    // the region is not absent.  Safe alongside mergeNode() stripe writers
+    bool graft(OcTree *source, OcTreeNode *node, const OcTreeKey& key, unsigned int depth,
+               uint8_t owner, bool own, bool move);
+
+    // Let several threads call mergeNode() at once.  Each subtree at depth is
+    // guarded by one of num_stripes locks (by key hash), so writers in
+    // different regions never wait on each other.  Writes coarser than depth,
+    // or that have to create the subtree, wait for every stripe.  0 stripes
+    // turns this off.  Only call with no writer running
+    void setStripes(unsigned int depth, unsigned int num_stripes);
+    // Fold what the stripe writers did (node count, dirty keys) into the
+    // tree.  Call with no writer running, pruneDirty() does it too
+    void collectStripes();
+
+    // Delete every descendant of node, leaving it a leaf
+    void deleteChildren(OcTreeNodeOwned *node);
+
+    // Remember a written voxel so pruneDirty() revisits its path.  Writes
+    // that are marked dirty can use lazy_eval, the inner nodes on the path
+    // are updated by pruneDirty()
+    void markDirty(const OcTreeKey& key) { dirty_keys.insert(adjustKeyAtDepth(key, tree_depth - 1)); }
+    // Update and prune only the paths of voxels written since the last call
+    void pruneDirty();
+
+    // Collapse blocks at the given depth farther than radius from center,
+    // farthest first, to their max log-odds until about bytes_to_free is
+    // released.  Only fully known subtrees are collapsed, so unobserved
+    // voxels stay absent.  Returns the estimated number of bytes freed.
+    size_t coarsen(const point3d& center, double radius, unsigned int depth,
+                   size_t bytes_to_free);
+    // Collapse the fully known subtrees under node the same way.  Returns
+    // the estimated number of bytes freed
+    size_t collapse(OcTreeNodeOwned *node);
+
+  protected:
+    // Parents of voxels written since the last pruneDirty()
+    KeySet dirty_keys;
+
+    // Writers below the stripe depth keep their node count change and dirty
+    // keys here until collectStripes()
+    struct Stripe {
+      Stripe() : num_nodes(0) {}
+      std::mutex mutex;
+      KeySet dirty_keys;
+      long num_nodes;
+    };
+    std::vector<Stripe*> stripes;
+    unsigned int stripe_depth;
+
+    // Lock what a write at key/depth needs.  Returns the stripe and its
+    // existing subtree node, or NULL with every stripe held and the root
+    // (possibly NULL) at depth 0
+    Stripe* lockSubtree(const OcTreeKey& key, unsigned int depth, OcTreeNodeOwned*& node,
+                        unsigned int& node_depth);
+    void unlockSubtree(Stripe *stripe, long num_nodes);
+    void markDirty(Stripe *stripe, const OcTreeKey& key);
+
+    // Walk from node (at node_depth) down to key/depth and merge there.
+    // Returns false if the rules kept a coarser block untouched
+    bool mergeFrom(OcTreeNodeOwned *node, unsigned int node_depth, const OcTreeKey& key,
+                   unsigned int depth, float log_odds, bool replace, bool overwrite,
+                   uint8_t owner, bool created, long& num_nodes);
+    void mergeRecurs(OcTreeNodeOwned *node, float log_odds, bool replace, bool overwrite,
+                     uint8_t owner, long& num_nodes);
+    OcTreeNodeOwned* graftRecurs(OcTree *source, OcTreeNode *node, uint8_t owner, bool own,
+                                 bool move, long& num_nodes);
+    // Node creation, expansion and pruning that count into num_nodes instead
+    // of tree_size, which stripe writers cannot share
+    OcTreeNodeOwned* addChild(OcTreeNodeOwned *node, unsigned int pos, long& num_nodes);
+    void expandLeaf(OcTreeNodeOwned *node, long& num_nodes);
+    bool pruneLeafs(OcTreeNodeOwned *node, long& num_nodes);
+    // Collapse every fully known subtree under node into a leaf, adding the
+    // bytes released to freed.  Returns whether node's subtree is fully known
+    bool collapseRecurs(OcTreeNodeOwned *node, size_t& freed);
+};
+
+} // namespace octomap
+
+#endif
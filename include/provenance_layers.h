@@ -0,0 +1,128 @@
+#ifndef PROVENANCE_LAYERS_H_
+#define PROVENANCE_LAYERS_H_
+
+#include <octomap/octomap.h>
+#include <octomap/OcTreeStamped.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "octree_owned.h"
+
+using namespace octomap;
+
+// One owner's layer.  Pruned diff nodes are kept as blocks at their own
+// depth, and only split where part of a block is written or erased.  Each
+// voxel keeps the stamp that wins among the writes to it, so a layer holds
+// what merge_maps() would have left had only its owner written
+class LayerTree : public OcTreeStamped {
+  public:
+    LayerTree(double resolution) : OcTreeStamped(resolution) {}
+
+    // Whether a voxel stamped stamp takes the place of one stamped best
+    static bool wins(unsigned int stamp, unsigned int best);
+
+    // Write a block at the given depth (0 = root) into every voxel under it
+    // that is absent or whose stamp it wins over, splitting a coarser leaf
+    // on the way down only if the write wins over it
+    void writeBlock(const OcTreeKey& key, unsigned int depth, float log_odds,
+                    unsigned int stamp);
+    // Delete the voxels of a block at the given depth that still hold stamp,
+    // leaving those a later write won; returns whether any were deleted
+    bool eraseBlock(const OcTreeKey& key, unsigned int depth, unsigned int stamp);
+
+  private:
+    void writeRecurs(OcTreeNodeStamped *node, bool created, float log_odds, unsigned int stamp);
+    bool eraseRecurs(OcTreeNodeStamped *node, unsigned int stamp, bool& erased);
+};
+
+// Keeps every owner's contribution to the merged map in its own tree, so one
+// owner can be removed or re-merged without rebuilding from every diff.  The
+// composite (tree_merged) is only recomputed at blocks whose layers changed.
+// Each layer voxel is stamped with the order of the diff that won it
+// and whether that diff could overwrite, so a recomputed voxel ends up as
+// merge_maps() left it.
+class ProvenanceLayers {
+  public:
+    ProvenanceLayers(double resolution, const std::string& self);
+    ~ProvenanceLayers();
+
+    // Record a diff that was merged into the composite for this owner, with
+    // the overwrite flag it was merged with, or with mark_dirty, one the
+    // composite still needs to pick up on refresh.  Returns the diff's stamp
+    template <class TREE>
+    unsigned int insert(const std::string& owner, uint8_t owner_id, const TREE *diff,
+                        bool overwrite, bool mark_dirty = false);
+    // Write an owner's diff back with the stamp insert() gave it, where it
+    // wins over what the layer holds now, marking what it wins for recomputation
+    template <class TREE>
+    void restore(const std::string& owner, uint8_t owner_id, const TREE *diff,
+                 unsigned int stamp);
+    // Remove an owner's whole layer, marking its blocks for recomputation
+    void drop(const std::string& owner);
+    // Remove the voxels an owner's diff still holds in its layer, given the
+    // stamp insert() gave it, marking them for recomputation.  Voxels where
+    // it displaced an earlier diff of the owner are left empty; restore()
+    // the earlier diffs to fill them again
+    template <class TREE>
+    void erase(const std::string& owner, const TREE *diff, unsigned int stamp);
+    // Recompute the marked blocks of the composite from the remaining layers
+    void refresh(OcTreeOwned *composite);
+
+    bool dirty() const;
+    // Marked blocks by depth
+    const std::vector<KeySet>& dirtyBlocks() const { return dirty_blocks; }
+    OcTreeStamped* layer(const std::string& owner);
+
+  private:
+    struct Layer {
+      LayerTree *tree;
+      uint8_t id;
+    };
+
+    double resolution;
+    std::string self;
+    std::map<std::string, Layer> layers;
+    std::vector<KeySet> dirty_blocks;
+    // Order of the next inserted diff; voxel timestamps hold it shifted
+    // left by one, with the overwrite flag in the low bit
+    unsigned int next_stamp;
+
+    LayerTree* layerFor(const std::string& owner, uint8_t owner_id);
+    void refreshBlock(OcTreeOwned *composite, const OcTreeKey& key, unsigned int depth);
+};
+
+template <class TREE>
+unsigned int ProvenanceLayers::insert(const std::string& owner, uint8_t owner_id,
+                                      const TREE *diff, bool overwrite, bool mark_dirty) {
+  // Inside its layer, the owner's diffs follow the same rules as between
+  // layers, so a late diff that could not overwrite keeps the earlier value
+  LayerTree *tree = layerFor(owner, owner_id);
+  unsigned int stamp = (next_stamp++ << 1) | (overwrite ? 1 : 0);
+  for (typename TREE::leaf_iterator it = diff->begin_leafs(); it != diff->end_leafs(); ++it) {
+    tree->writeBlock(it.getKey(), it.getDepth(), it->getLogOdds(), stamp);
+    if (mark_dirty) dirty_blocks[it.getDepth()].insert(it.getKey());
+  }
+  return stamp;
+}
+
+template <class TREE>
+void ProvenanceLayers::restore(const std::string& owner, uint8_t owner_id, const TREE *diff,
+                               unsigned int stamp) {
+  LayerTree *tree = layerFor(owner, owner_id);
+  for (typename TREE::leaf_iterator it = diff->begin_leafs(); it != diff->end_leafs(); ++it) {
+    tree->writeBlock(it.getKey(), it.getDepth(), it->getLogOdds(), stamp);
+    dirty_blocks[it.getDepth()].insert(it.getKey());
+  }
+}
+
+template <class TREE>
+void ProvenanceLayers::erase(const std::string& owner, const TREE *diff, unsigned int stamp) {
+  std::map<std::string, Layer>::iterator lit = layers.find(owner);
+  if (lit == layers.end()) return;
+  for (typename TREE::leaf_iterator it = diff->begin_leafs(); it != diff->end_leafs(); ++it) {
+    if (lit->second.tree->eraseBlock(it.getKey(), it.getDepth(), stamp))
+      dirty_blocks[it.getDepth()].insert(it.getKey());
+  }
+}
+
+#endif
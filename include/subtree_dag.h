@@ -0,0 +1,96 @@
+#ifndef SUBTREE_DAG_H_
+#define SUBTREE_DAG_H_
+
+#include <octomap/octomap.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "octree_owned.h"
+
+using namespace octomap;
+
+// Read-only, hash-consed copy of an octree (sparse voxel DAG).  Identical
+// subtrees (same values, same structure) are stored once, which collapses the
+// repeated blocks of large free-space and solid regions.  Used to archive
+// regions and to send compact snapshots; expand back with toTree().
+class SubtreeDag {
+  public:
+    SubtreeDag() : resolution(0), root(NONE) {}
+
+    // Build from a whole tree, or only from the subtree under node
+    template <class TREE>
+    void build(const TREE& tree, const typename TREE::NodeType *node = NULL);
+
+    // Recreate the tree, placing the DAG root at key/depth (default: tree root)
+    void toTree(OcTreeOwned *tree) const;
+    void toTree(OcTreeOwned *tree, const OcTreeKey& key, unsigned int depth) const;
+
+    // Compact stream: value table plus varint encoded node table.  read()
+    // rejects streams deeper than an octree can hold
+    void write(std::ostream& s) const;
+    bool read(std::istream& s);
+
+    void clear();
+    bool empty() const { return root == NONE; }
+    double getResolution() const { return resolution; }
+    size_t numNodes() const { return nodes.size(); }
+    size_t memoryUsage() const;
+
+  private:
+    static const uint32_t NONE = 0xffffffff;
+    // Levels below the root of every octomap tree
+    static const unsigned int MAX_DEPTH = 16;
+
+    struct Node {
+      float log_odds;
+      uint8_t mask;
+      uint8_t own;
+      uint32_t first_child;
+    };
+
+    double resolution;
+    uint32_t root;
+    std::vector<Node> nodes;
+    std::vector<uint32_t> edges;
+    // Content key to node id, only used while building
+    std::unordered_map<std::string, uint32_t> index;
+
+    uint32_t intern(float log_odds, bool own, uint8_t mask, const uint32_t *children);
+    void toTreeRecurs(OcTreeOwned *tree, uint32_t id, const OcTreeKey& key,
+                      unsigned int depth) const;
+
+    template <class TREE, class NODE>
+    uint32_t buildRecurs(const TREE& tree, const NODE *node);
+
+    static bool nodeOwn(const OcTreeNode *node) { return false; }
+    static bool nodeOwn(const OcTreeNodeOwned *node) { return node->isOwn(); }
+};
+
+template <class TREE>
+void SubtreeDag::build(const TREE& tree, const typename TREE::NodeType *node) {
+  clear();
+  resolution = tree.getResolution();
+  if (!node) node = tree.getRoot();
+  if (node) root = buildRecurs(tree, node);
+  index.clear();
+}
+
+template <class TREE, class NODE>
+uint32_t SubtreeDag::buildRecurs(const TREE& tree, const NODE *node) {
+  // Children are interned first, so identical subtrees map to the same id
+  uint32_t children[8];
+  uint8_t mask = 0;
+  unsigned int n = 0;
+  if (tree.nodeHasChildren(node)) {
+    for (unsigned int i = 0; i < 8; i++) {
+      if (tree.nodeChildExists(node, i)) {
+        children[n++] = buildRecurs(tree, tree.getNodeChild(node, i));
+        mask |= (1 << i);
+      }
+    }
+  }
+  return intern(node->getLogOdds(), nodeOwn(node), mask, children);
+}
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef TILE_STORE_H_
+#define TILE_STORE_H_
+
+#include <octomap/octomap.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "octree_owned.h"
+
+using namespace octomap;
+
+// Memory-mapped spill file for serialized tiles.  Writes are queued and
+// copied into the mapping by a background thread; a tile that is read back
+// before it was written is served straight from the queue.
+class TileStore {
+  public:
+    TileStore(const std::string& path);
+    ~TileStore();
+
+    bool isOpen() const { return fd >= 0; }
+    // Queue a tile for write-back
+    void put(const OcTreeKey& key, const std::string& data);
+    // Read a tile and release its slot
+    bool take(const OcTreeKey& key, std::string& data);
+    bool contains(const OcTreeKey& key);
+
+  private:
+    struct Slot {
+      size_t offset;
+      size_t capacity;
+      size_t length;
+    };
+
+    std::string path;
+    int fd;
+    char *mapped;
+    size_t mapped_size;
+    size_t end;
+
+    std::unordered_map<OcTreeKey, Slot, OcTreeKey::KeyHash> index;
+    std::multimap<size_t, size_t> free_slots;
+    std::unordered_map<OcTreeKey, std::string, OcTreeKey::KeyHash> pending;
+    std::deque<OcTreeKey> queue;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::thread writer;
+    bool stop;
+
+    void writeLoop();
+    bool reserve(size_t size);
+};
+
+// Out-of-core residency for tree_merged.  Subtrees at a fixed depth (tiles)
+// that were not touched for max_age seconds, or the least recently used ones
+// past max_resident, are serialized to the store and collapsed in the tree
+// to a single placeholder leaf.  touch() faults them back in before anything
+// writes to them.
+class TileCache {
+  public:
+    TileCache(OcTreeOwned *tree, unsigned int depth, const std::string& path,
+              double max_age, size_t max_resident);
+
+    bool isOpen() const { return store.isOpen(); }
+
+    // Make every tile a diff covers resident and mark it used
+    template <class TREE>
+    void touch(TREE *diff, double now);
+    // Same for the tiles under one node at any depth
+    void touch(const OcTreeKey& key, unsigned int key_depth, double now);
+
+    void evict(double now);
+
+    size_t numResident() const { return entries.size(); }
+
+  private:
+    struct Entry {
+      std::list<OcTreeKey>::iterator lru_pos;
+      double last_used;
+    };
+
+    OcTreeOwned *tree;
+    unsigned int depth;
+    double max_age;
+    size_t max_resident;
+    TileStore store;
+
+    std::list<OcTreeKey> lru;
+    std::unordered_map<OcTreeKey, Entry, OcTreeKey::KeyHash> entries;
+    // Evicted tiles by Morton code, so those under a coarser block are one range
+    std::map<uint64_t, OcTreeKey> evicted;
+
+    uint64_t mortonCode(const OcTreeKey& key) const;
+
+    void use(const OcTreeKey& tile, double now);
+    void load(const OcTreeKey& tile);
+    void unload(const OcTreeKey& tile);
+};
+
+template <class TREE>
+void TileCache::touch(TREE *diff, double now) {
+  // Nodes at the tile depth are exactly the tiles the diff writes to;
+  // coarser leaves can span several tiles
+  for (typename TREE::tree_iterator it = diff->begin_tree(depth), end = diff->end_tree();
+       it != end; ++it) {
+    if (it.getDepth() == depth)
+      touch(it.getKey(), depth, now);
+    else if (it.isLeaf())
+      touch(it.getKey(), it.getDepth(), now);
+  }
+}
+
+#endif
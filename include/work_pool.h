@@ -0,0 +1,57 @@
+#ifndef WORK_POOL_H_
+#define WORK_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads, each with its own task deque.  A worker runs
+// its newest task first and, once its deque is empty, steals the oldest task
+// of another one, so a single large task never leaves the other cores idle.
+class WorkPool {
+  public:
+    typedef std::function<void()> Task;
+
+    // num_threads = 0 starts one worker per core.  If cpus is not empty,
+    // worker i is pinned to cpus[i % cpus.size()].  Workers run at the given
+    // nice value
+    WorkPool(unsigned int num_threads, const std::vector<int>& cpus, int nice);
+    ~WorkPool();
+
+    // From a worker, the task goes on its own deque, otherwise round robin
+    void submit(const Task& task);
+    // Run tasks on the calling thread too until every submitted one finished
+    void wait();
+
+    unsigned int size() const { return queues.size(); }
+
+  private:
+    struct Queue {
+      std::mutex mutex;
+      std::deque<Task> tasks;
+    };
+
+    std::vector<Queue*> queues;
+    std::vector<std::thread> threads;
+    unsigned int next;
+
+    // Tasks sitting in a deque, and submitted ones not yet finished
+    std::atomic<size_t> queued;
+    std::atomic<size_t> unfinished;
+
+    std::mutex mutex;
+    std::condition_variable work_cond;
+    std::condition_variable done_cond;
+    bool stop;
+
+    void workLoop(unsigned int self, int cpu, int nice);
+    // Own deque from the back, then the others from the front
+    bool pop(int self, Task& task);
+    void run(Task& task);
+};
+
+#endif
@@ -0,0 +1,213 @@
+#include <chunk_transfer.h>
+#include <string.h>
+#include <algorithm>
+#include <random>
+
+uint32_t crc32(const uint8_t *data, size_t size, uint32_t crc) {
+  // Bitwise CRC-32 (IEEE), once per snapshot and chunk, so no table
+  crc = ~crc;
+  for (size_t i = 0; i < size; i++) {
+    crc ^= data[i];
+    for (int b = 0; b < 8; b++)
+      crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+  }
+  return ~crc;
+}
+
+uint32_t chunkCrc(const Chunk& chunk) {
+  // Every field but the checksum itself, little endian, then the data
+  uint32_t fields[] = {chunk.epoch, chunk.payload_id, chunk.index, chunk.num_chunks,
+                       chunk.payload_size, chunk.offset, chunk.payload_crc};
+  uint8_t header[sizeof(fields) + 1];
+  size_t n = 0;
+  for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+    for (int b = 0; b < 4; b++)
+      header[n++] = (fields[i] >> (8 * b)) & 0xff;
+    if (i == 0) header[n++] = chunk.kind;
+  }
+  return crc32(chunk.data.data(), chunk.data.size(), crc32(header, sizeof(header)));
+}
+
+ChunkSender::ChunkSender(size_t chunk_size, size_t max_payloads)
+  : chunk_size(chunk_size ? chunk_size : 1), max_payloads(max_payloads ? max_payloads : 1),
+    sender_epoch(std::random_device()()), next_id(0) {
+}
+
+uint32_t ChunkSender::add(const std::vector<uint8_t>& payload, uint8_t kind) {
+  uint32_t id = next_id++;
+  Payload& stored = payloads[id];
+  stored.kind = kind;
+  stored.crc = crc32(payload.data(), payload.size());
+  stored.data = payload;
+  while (payloads.size() > max_payloads) payloads.erase(payloads.begin());
+  return id;
+}
+
+uint32_t ChunkSender::numChunks(uint32_t id) const {
+  std::map<uint32_t, Payload>::const_iterator it = payloads.find(id);
+  if (it == payloads.end()) return 0;
+  // An empty payload still goes out as one empty chunk
+  return std::max((size_t)1, (it->second.data.size() + chunk_size - 1) / chunk_size);
+}
+
+bool ChunkSender::chunk(uint32_t id, uint32_t index, Chunk& out) const {
+  std::map<uint32_t, Payload>::const_iterator it = payloads.find(id);
+  if (it == payloads.end() || index >= numChunks(id)) return false;
+
+  const std::vector<uint8_t>& payload = it->second.data;
+  size_t offset = index * chunk_size;
+  size_t size = std::min(chunk_size, payload.size() - offset);
+  out.epoch = sender_epoch;
+  out.kind = it->second.kind;
+  out.payload_id = id;
+  out.index = index;
+  out.num_chunks = numChunks(id);
+  out.payload_size = payload.size();
+  out.offset = offset;
+  out.payload_crc = it->second.crc;
+  out.data.assign(payload.begin() + offset, payload.begin() + offset + size);
+  out.crc = chunkCrc(out);
+  return true;
+}
+
+ChunkReassembler::ChunkReassembler(size_t max_payloads, size_t max_bytes)
+  : max_payloads(max_payloads ? max_payloads : 1), max_bytes(max_bytes), buffered(0) {
+}
+
+bool ChunkReassembler::add(const std::string& owner, const Chunk& chunk, double now,
+                           std::vector<uint8_t>& payload) {
+  PayloadKey key(owner, chunk.epoch, chunk.payload_id);
+  if (completed.count(key)) return false;
+
+  // Corrupt or inconsistent chunks are treated as lost.  Every chunk but an
+  // empty payload's only one holds data, so there are no more chunks than
+  // payload bytes, and the payload size is bounded before anything is
+  // allocated for it
+  if (chunkCrc(chunk) != chunk.crc) return false;
+  if (chunk.index >= chunk.num_chunks ||
+      (uint64_t)chunk.offset + chunk.data.size() > chunk.payload_size) return false;
+  if (chunk.payload_size > max_bytes ||
+      chunk.num_chunks > std::max<uint32_t>(chunk.payload_size, 1)) return false;
+
+  // Ids run consecutively within an epoch, so ids between the newest seen
+  // and this one were lost whole.  The newest of them are kept to be asked
+  // for, leaving room for this payload
+  std::map<std::string, std::pair<uint32_t, uint32_t>>::iterator next = next_ids.find(owner);
+  if (next == next_ids.end() || next->second.first != chunk.epoch) {
+    next_ids[owner] = std::make_pair(chunk.epoch, chunk.payload_id + 1);
+  } else if (chunk.payload_id - next->second.second < 0x80000000u) {
+    uint32_t skipped = std::min<uint32_t>(chunk.payload_id - next->second.second, max_payloads);
+    for (uint32_t id = chunk.payload_id - skipped;
+         id != chunk.payload_id && partials.size() + 1 < max_payloads; id++) {
+      PayloadKey lost(owner, chunk.epoch, id);
+      if (completed.count(lost) || partials.count(lost)) continue;
+      Partial partial;
+      partial.num_chunks = 0;
+      partial.kind = 0;
+      partial.payload_crc = 0;
+      partial.num_have = 0;
+      partial.last_update = now;
+      partial.requested = false;
+      partials.insert(std::make_pair(lost, partial));
+    }
+    next->second.second = chunk.payload_id + 1;
+  }
+
+  std::map<PayloadKey, Partial>::iterator it = partials.find(key);
+  // A skipped payload is set up afresh by its first chunk
+  if (it != partials.end() && it->second.num_chunks == 0) {
+    partials.erase(it);
+    it = partials.end();
+  }
+  if (it == partials.end()) {
+    // Make room by dropping the payloads that have been idle longest
+    while (!partials.empty() && (partials.size() >= max_payloads ||
+                                 buffered + chunk.payload_size > max_bytes)) {
+      std::map<PayloadKey, Partial>::iterator oldest = partials.begin();
+      for (std::map<PayloadKey, Partial>::iterator p = partials.begin(); p != partials.end(); ++p)
+        if (p->second.last_update < oldest->second.last_update) oldest = p;
+      buffered -= oldest->second.data.size();
+      partials.erase(oldest);
+    }
+
+    Partial partial;
+    partial.num_chunks = chunk.num_chunks;
+    partial.kind = chunk.kind;
+    partial.payload_crc = chunk.payload_crc;
+    partial.num_have = 0;
+    partial.requested = false;
+    partial.data.resize(chunk.payload_size);
+    partial.have.assign(chunk.num_chunks, false);
+    it = partials.insert(std::make_pair(key, partial)).first;
+    buffered += chunk.payload_size;
+  }
+
+  Partial& partial = it->second;
+  if (chunk.num_chunks != partial.num_chunks || chunk.payload_size != partial.data.size() ||
+      chunk.payload_crc != partial.payload_crc || chunk.kind != partial.kind)
+    return false;
+  partial.last_update = now;
+  if (partial.have[chunk.index]) return false;
+
+  if (!chunk.data.empty())
+    memcpy(&partial.data[chunk.offset], chunk.data.data(), chunk.data.size());
+  partial.have[chunk.index] = true;
+  partial.num_have++;
+  if (partial.num_have < partial.num_chunks) return false;
+
+  // Chunks that each passed but do not add up to the payload, as when
+  // they overlap, are all thrown away and requested again
+  if (crc32(partial.data.data(), partial.data.size()) != partial.payload_crc) {
+    partial.have.assign(partial.num_chunks, false);
+    partial.num_have = 0;
+    return false;
+  }
+
+  payload.swap(partial.data);
+  buffered -= payload.size();
+  partials.erase(it);
+
+  completed.insert(key);
+  completed_order.push_back(key);
+  while (completed_order.size() > 4 * max_payloads) {
+    completed.erase(completed_order.front());
+    completed_order.pop_front();
+  }
+  return true;
+}
+
+void ChunkReassembler::missing(double now, double timeout, std::vector<Gaps>& gaps) {
+  std::map<PayloadKey, Partial>::iterator it = partials.begin();
+  while (it != partials.end()) {
+    Partial& partial = it->second;
+    if (now - partial.last_update < timeout) {
+      ++it;
+      continue;
+    }
+
+    Gaps g;
+    g.owner = std::get<0>(it->first);
+    g.epoch = std::get<1>(it->first);
+    g.payload_id = std::get<2>(it->first);
+    std::map<std::string, std::pair<uint32_t, uint32_t>>::iterator next = next_ids.find(g.owner);
+    if ((next != next_ids.end() && next->second.first != g.epoch) ||
+        (partial.num_chunks == 0 && partial.requested)) {
+      buffered -= partial.data.size();
+      partials.erase(it++);
+      continue;
+    }
+
+    if (partial.num_chunks == 0) g.ranges.push_back(std::make_pair(0u, 0xffffffffu));
+    for (uint32_t i = 0; i < partial.num_chunks; i++) {
+      if (partial.have[i]) continue;
+      if (!g.ranges.empty() && g.ranges.back().second == i - 1)
+        g.ranges.back().second = i;
+      else
+        g.ranges.push_back(std::make_pair(i, i));
+    }
+    gaps.push_back(g);
+    partial.requested = true;
+    partial.last_update = now;
+    ++it;
+  }
+}
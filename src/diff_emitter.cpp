@@ -0,0 +1,27 @@
+#include <diff_emitter.h>
+#include <algorithm>
+
+DiffEmitter::DiffEmitter(double min_volume, double max_interval, double bandwidth, double burst)
+  : min_volume(min_volume), max_interval(max_interval), bandwidth(bandwidth), burst(burst),
+    tokens(burst), last_refill(-1), last_emit(0), load(1) {
+}
+
+bool DiffEmitter::ready(double changed_volume, double now) const {
+  if (changed_volume <= 0) return false;
+  return (changed_volume >= min_volume * load) || (now - last_emit >= max_interval);
+}
+
+void DiffEmitter::refill(double now) {
+  if (last_refill >= 0)
+    tokens = std::min(burst, tokens + (now - last_refill) * bandwidth / load);
+  last_refill = now;
+}
+
+bool DiffEmitter::consume(double bytes, double now) {
+  if (bandwidth <= 0) return true;
+
+  refill(now);
+  if (tokens < bytes && tokens < burst) return false;
+  tokens = std::max(tokens - bytes, -burst);
+  return true;
+}
@@ -177,14 +177,16 @@ void transformTree(OcTree *tree, Eigen::Matrix4f& transform) {
   Eigen::Matrix3f rotation;
   Eigen::Matrix3f invRotation;
   Eigen::Matrix4f invTransform;
+  Eigen::Vector3f invTranslation;
   rotation << transform(0, 0), transform(0, 1), transform(0, 2),
               transform(1, 0), transform(1, 1), transform(1, 2),
-              transform(2, 0), transform(0, 2), transform(2,  2);
+              transform(2, 0), transform(2, 1), transform(2,  2);
   invRotation = rotation.transpose();
+  invTranslation = -invRotation * transform.block<3, 1>(0, 3);
   invTransform <<
-    invRotation(0, 0), invRotation(0, 1), invRotation(0, 2), -transform(0, 3),
-    invRotation(1, 0), invRotation(1, 1), invRotation(1, 2), -transform( 1, 3),
-    invRotation(2, 0), invRotation(2, 1), invRotation(2, 2), -transform( 2, 3),
+    invRotation(0, 0), invRotation(0, 1), invRotation(0, 2), invTranslation(0),
+    invRotation(1, 0), invRotation(1, 1), invRotation(1, 2), invTranslation(1),
+    invRotation(2, 0), invRotation(2, 1), invRotation(2, 2), invTranslation(2),
     0, 0, 0, 1;
 
   // size in each coordinate of each axis.
@@ -391,3 +393,19 @@ void align_maps(OcTree *tree1, OcTree *tree2, point3d translation,
     transformTree(tree2, transform);
   }
 }
+
+void anchorTree(OcTree *tree, const Pose6D& anchor) {
+  // Nothing to do for a diff still in its original frame
+  if (anchor == Pose6D()) return;
+
+  Eigen::Matrix4f transform;
+  std::vector<double> coeffs;
+  anchor.rot().toRotMatrix(coeffs);
+
+  transform << coeffs[0], coeffs[1], coeffs[2], anchor.x(),
+               coeffs[3], coeffs[4], coeffs[5], anchor.y(),
+               coeffs[6], coeffs[7], coeffs[8], anchor.z(),
+               0, 0, 0, 1;
+
+  transformTree(tree, transform);
+}
@@ -1,55 +1,293 @@
 #include <octomap_merger.h>
+#include <algorithm>
+#include <limits>
 
-double build_diff_tree(OcTree *tree1, OcTree *tree2, OcTree *tree_diff) {
-  // Find the differences in tree2 from tree1 and write to a new diff tree
-
-  // Expand tree so we search all nodes
-  tree2->expand();
-  double num_new_nodes = 0;
-
-  // traverse nodes in tree2 to add them to tree1
-  for (OcTree::leaf_iterator it = tree2->begin_leafs(); it != tree2->end_leafs(); ++it) {
-    OcTreeKey nodeKey = it.getKey();
-    OcTreeNode *nodeIn1 = tree1->search(nodeKey);
-    if (nodeIn1 != NULL) {
-      // Change the diff tree (may be add, or may be new) if the two maps are different
-      if (nodeIn1->getOccupancy() != it->getOccupancy()) {
-        tree_diff->setNodeValue(nodeKey, it->getLogOdds());
-      }
-    } else {
-      // Add to the diff tree if it's a new node
-      OcTreeNode *newDiffNode = tree_diff->setNodeValue(nodeKey, it->getLogOdds());
-      num_new_nodes++;
+// Outcome of comparing one region of the new map against the old one
+enum DiffResult { DIFF_NONE, DIFF_PARTIAL, DIFF_FULL };
+
+// A known voxel is sent again when it flips between free and occupied, or
+// when its log-odds moved more than thresh from the value last sent
+static bool voxel_changed(OcTree *tree2, const OcTreeNode *node1, const OcTreeNode *node2,
+                          double thresh) {
+  if (thresh <= 0) return node1->getOccupancy() != node2->getOccupancy();
+  return (tree2->isNodeOccupied(node1) != tree2->isNodeOccupied(node2)) ||
+         (fabs(node2->getLogOdds() - node1->getLogOdds()) > thresh);
+}
+
+static DiffResult diff_recurs(OcTreeOwned *tree1, OcTree *tree2, OcTreeOwned *tree_diff,
+                              OcTreeNodeOwned *node1, OcTreeNode *node2, const OcTreeKey& key,
+                              unsigned int depth, double thresh, float& log_odds,
+                              double& num_new_nodes, double& num_changed_nodes) {
+  bool leaf1 = (node1 == NULL) || !tree1->nodeHasChildren(node1);
+  bool leaf2 = !tree2->nodeHasChildren(node2);
+
+  // Both uniform over this region: the whole region either changed or not
+  if (leaf2 && leaf1) {
+    log_odds = node2->getLogOdds();
+    double num_voxels = ldexp(1.0, 3 * (tree2->getTreeDepth() - depth));
+    if (node1 == NULL) {
+      num_new_nodes += num_voxels;
+      num_changed_nodes += num_voxels;
+      return DIFF_FULL;
+    }
+    if (!voxel_changed(tree2, node1, node2, thresh)) return DIFF_NONE;
+    num_changed_nodes += num_voxels;
+    return DIFF_FULL;
+  }
+
+  // A pruned node stands for all of its children
+  DiffResult results[8];
+  float values[8];
+  OcTreeKey keys[8];
+  unsigned int center_offset = (1 << (tree2->getTreeDepth() - 1)) >> (depth + 1);
+  int num_full = 0;
+  float first_value = 0;
+  bool uniform = true;
+  for (unsigned int i = 0; i < 8; i++) {
+    results[i] = DIFF_NONE;
+    OcTreeNode *child2 = leaf2 ? node2 :
+        (tree2->nodeChildExists(node2, i) ? tree2->getNodeChild(node2, i) : NULL);
+    if (child2 == NULL) continue;
+    OcTreeNodeOwned *child1 = leaf1 ? node1 :
+        (tree1->nodeChildExists(node1, i) ? tree1->getNodeChild(node1, i) : NULL);
+
+    computeChildKey(i, center_offset, key, keys[i]);
+    results[i] = diff_recurs(tree1, tree2, tree_diff, child1, child2, keys[i], depth + 1,
+                             thresh, values[i], num_new_nodes, num_changed_nodes);
+    if (results[i] == DIFF_FULL) {
+      if (num_full == 0) first_value = values[i];
+      else if (values[i] != first_value) uniform = false;
+      num_full++;
     }
   }
 
+  // Every child changed to the same value: let the parent emit the block
+  if (num_full == 8 && uniform) {
+    log_odds = first_value;
+    return DIFF_FULL;
+  }
+
+  DiffResult result = DIFF_NONE;
+  for (unsigned int i = 0; i < 8; i++) {
+    if (results[i] == DIFF_FULL)
+      tree_diff->setNodeValueAtDepth(keys[i], depth + 1, values[i], true);
+    if (results[i] != DIFF_NONE) result = DIFF_PARTIAL;
+  }
+  return result;
+}
+
+double build_diff_tree(OcTreeOwned *tree1, OcTree *tree2, OcTreeOwned *tree_diff,
+                       double thresh, double *num_changed) {
+  // Find the differences in tree2 from tree1 (what was last sent) and write
+  // to a new diff tree.  thresh = 0 sends any change, otherwise only state
+  // changes and log-odds moves beyond thresh.  Both trees are walked together
+  // without expanding, and changes are written at the coarsest level where
+  // they are uniform, so the diff tree comes out already pruned.  Returns the
+  // number of new voxels, and optionally the number of new or changed ones.
+  double num_new_nodes = 0, num_changed_nodes = 0;
+  if (num_changed) *num_changed = 0;
+  if (tree2->getRoot() == NULL) return num_new_nodes;
+
+  unsigned int center = 1 << (tree2->getTreeDepth() - 1);
+  OcTreeKey root_key(center, center, center);
+  float log_odds;
+  if (diff_recurs(tree1, tree2, tree_diff, tree1->getRoot(), tree2->getRoot(), root_key, 0,
+                  thresh, log_odds, num_new_nodes, num_changed_nodes) == DIFF_FULL)
+    tree_diff->setNodeValueAtDepth(root_key, 0, log_odds, true);
+
+  tree_diff->updateInnerOccupancy();
+  if (num_changed) *num_changed = num_changed_nodes;
   return num_new_nodes;
 }
 
-void merge_maps(OcTreeStamped *tree1, OcTree *tree2, bool replace, bool overwrite) {
+template <class TREE>
+void merge_maps(OcTreeOwned *tree1, TREE *tree2, bool replace, bool overwrite,
+                uint8_t owner) {
   // replace = always replace an existing node
-  // overwrite = replace an existing node if the node is marked with timestamp = 0
-
-  // Expand tree so we search all nodes
-  tree2->expand();
-
-  // Timestamp to mark a node as an original from the owner or not
-  int ts = replace ? 1 : 0;
-
-  // traverse nodes in tree2 to add them to tree1
-  for (OcTree::leaf_iterator it = tree2->begin_leafs(); it != tree2->end_leafs(); ++it) {
-    OcTreeKey nodeKey = it.getKey();
-    OcTreeNodeStamped *nodeIn1 = tree1->search(nodeKey);
-    if (nodeIn1 != NULL) {
-      // Replace the node in tree1 if conditions are met
-      if (replace || (overwrite && (nodeIn1->getTimestamp() == 0))) {
-        OcTreeNodeStamped *updatedNode = tree1->setNodeValue(nodeKey, it->getLogOdds());
-        updatedNode->setTimestamp(ts);
-      }
+  // overwrite = replace an existing node if it is not marked as our own
+  // owner = id of the agent tree2 came from, stored with each node
+  // Inner nodes are left for tree1->pruneDirty()
+
+  // Pruned nodes in tree2 are merged at their own depth, so no expand here
+  for (typename TREE::leaf_iterator it = tree2->begin_leafs(); it != tree2->end_leafs(); ++it)
+    tree1->mergeNode(it.getKey(), it.getDepth(), it->getLogOdds(), replace, overwrite, owner);
+}
+
+template void merge_maps<OcTree>(OcTreeOwned*, OcTree*, bool, bool, uint8_t);
+template void merge_maps<OcTreeOwned>(OcTreeOwned*, OcTreeOwned*, bool, bool, uint8_t);
+
+template <class TREE>
+void merge_subtree(OcTreeOwned *tree1, TREE *tree2, const typename TREE::NodeType *node,
+                   const OcTreeKey& key, unsigned int depth, bool replace, bool overwrite,
+                   uint8_t owner) {
+  // merge_maps for only the part of tree2 under node, which sits at key/depth
+  if (!tree2->nodeHasChildren(node)) {
+    tree1->mergeNode(key, depth, node->getLogOdds(), replace, overwrite, owner);
+    return;
+  }
+
+  unsigned int center_offset = (1 << (tree2->getTreeDepth() - 1)) >> (depth + 1);
+  for (unsigned int i = 0; i < 8; i++) {
+    if (!tree2->nodeChildExists(node, i)) continue;
+    OcTreeKey child_key;
+    computeChildKey(i, center_offset, key, child_key);
+    merge_subtree(tree1, tree2, tree2->getNodeChild(node, i), child_key, depth + 1,
+                  replace, overwrite, owner);
+  }
+}
+
+template void merge_subtree<OcTree>(OcTreeOwned*, OcTree*, const OcTreeNode*,
+                                    const OcTreeKey&, unsigned int, bool, bool, uint8_t);
+
+void graft_diff(OcTreeOwned *tree1, OcTree *tree2, unsigned int depth, bool overwrite,
+                uint8_t owner) {
+  // Neighbor merge that moves each subtree of tree2 at depth (and each
+  // coarser leaf) over whole where tree1 has nothing there, and merges the
+  // others.  The iterator never goes below depth, so moving is safe
+  for (OcTree::tree_iterator it = tree2->begin_tree(depth), end = tree2->end_tree();
+       it != end; ++it) {
+    if (it.getDepth() < depth && !it.isLeaf()) continue;
+    if (!tree1->graft(tree2, &(*it), it.getKey(), it.getDepth(), owner, false, true))
+      merge_subtree(tree1, tree2, &(*it), it.getKey(), it.getDepth(), false, overwrite, owner);
+  }
+}
+
+void combine_stamped(OcTreeOwned *earlier, OcTreeOwned *later) {
+  // A later voxel that overwrites always wins, one that does not only fills
+  // voxels the earlier diff lacks.  Either way the winner keeps its stamp,
+  // which makes the combination associative, so pairs can be combined in
+  // any grouping as long as their order is kept
+  for (OcTreeOwned::leaf_iterator it = later->begin_leafs(); it != later->end_leafs(); ++it)
+    earlier->mergeNode(it.getKey(), it.getDepth(), it->getLogOdds(), it->isOwn(), false,
+                       it->getOwnerId());
+  earlier->pruneDirty();
+}
+
+void merge_stamped(OcTreeOwned *tree1, OcTreeOwned *stamped, const OcTreeNodeOwned *node,
+                   const OcTreeKey& key, unsigned int depth) {
+  // Neighbor merge of each voxel with the overwrite flag it was stamped with
+  if (!stamped->nodeHasChildren(node)) {
+    tree1->mergeNode(key, depth, node->getLogOdds(), false, node->isOwn(), node->getOwnerId());
+    return;
+  }
+
+  unsigned int center_offset = (1 << (stamped->getTreeDepth() - 1)) >> (depth + 1);
+  for (unsigned int i = 0; i < 8; i++) {
+    if (!stamped->nodeChildExists(node, i)) continue;
+    OcTreeKey child_key;
+    computeChildKey(i, center_offset, key, child_key);
+    merge_stamped(tree1, stamped, stamped->getNodeChild(node, i), child_key, depth + 1);
+  }
+}
+
+void split_diff(OcTreeOwned *diff, std::vector<OcTreeOwned*>& chunks,
+                unsigned int coarse_depth, size_t max_leaves) {
+  // The leaves of a pruned diff are disjoint, so the chunks can be merged
+  // in any order and each one on its own.  The first chunk holds every
+  // occupied leaf and the free blocks at coarse_depth or above, the rest
+  // hold the finer free space, coarsest first, max_leaves (0 = all) each
+  struct Leaf {
+    OcTreeKey key;
+    unsigned int depth;
+    float log_odds;
+  };
+  std::vector<Leaf> fine;
+
+  OcTreeOwned *first = new OcTreeOwned(diff->getResolution());
+  chunks.push_back(first);
+  for (OcTreeOwned::leaf_iterator it = diff->begin_leafs(); it != diff->end_leafs(); ++it) {
+    if (diff->isNodeOccupied(*it) || it.getDepth() <= coarse_depth) {
+      first->mergeNode(it.getKey(), it.getDepth(), it->getLogOdds(), true, false, 0);
     } else {
-      // Add the node to tree1
-      OcTreeNodeStamped *newNode = tree1->setNodeValue(nodeKey, it->getLogOdds());
-      newNode->setTimestamp(ts);
+      Leaf leaf = {it.getKey(), it.getDepth(), it->getLogOdds()};
+      fine.push_back(leaf);
+    }
+  }
+  first->pruneDirty();
+
+  std::stable_sort(fine.begin(), fine.end(),
+                   [](const Leaf& a, const Leaf& b) { return a.depth < b.depth; });
+  OcTreeOwned *chunk = NULL;
+  size_t num_leaves = 0;
+  for (size_t i = 0; i < fine.size(); i++) {
+    if (!chunk || (max_leaves && num_leaves >= max_leaves)) {
+      if (chunk) chunk->pruneDirty();
+      chunk = new OcTreeOwned(diff->getResolution());
+      chunks.push_back(chunk);
+      num_leaves = 0;
     }
+    chunk->mergeNode(fine[i].key, fine[i].depth, fine[i].log_odds, true, false, 0);
+    num_leaves++;
   }
+  if (chunk) chunk->pruneDirty();
+}
+
+void summarize_diff(OcTreeOwned *diff, unsigned int depth, bool binary,
+                    marble_octomap_merger::DiffSummary& summary) {
+  if (diff->getRoot() == NULL) return;
+
+  double x, y, z;
+  diff->getMetricMin(x, y, z);
+  summary.bbx_min[0] = x;
+  summary.bbx_min[1] = y;
+  summary.bbx_min[2] = z;
+  diff->getMetricMax(x, y, z);
+  summary.bbx_max[0] = x;
+  summary.bbx_max[1] = y;
+  summary.bbx_max[2] = z;
+
+  // The cells at depth, and leaves coarser than that at their own depth
+  for (OcTreeOwned::tree_iterator it = diff->begin_tree(depth), end = diff->end_tree();
+       it != end; ++it) {
+    if (it.getDepth() < depth && !it.isLeaf()) continue;
+    OcTreeKey key = it.getKey();
+    for (unsigned int k = 0; k < 3; k++)
+      summary.keys.push_back(key[k]);
+    summary.depths.push_back(it.getDepth());
+    // Receivers decode binary leaves to the clamping thresholds
+    float log_odds = it->getLogOdds();
+    if (binary)
+      log_odds = diff->isNodeOccupied(*it) ? diff->getClampingThresMaxLog()
+                                           : diff->getClampingThresMinLog();
+    summary.log_odds.push_back(diff->nodeHasChildren(&(*it)) ?
+                               std::numeric_limits<float>::quiet_NaN() : log_odds);
+  }
+}
+
+Overlap classify_diff(OcTreeOwned *merged, OcTreeOwned *footprint,
+                      const marble_octomap_merger::DiffSummary& summary, bool check_merged) {
+  // A cell another diff of the batch touched is about to change, so the
+  // diff is mixed.  Otherwise it is an insert if the merged map has nothing
+  // in any of its cells, and a duplicate if it holds each one as a single
+  // leaf of the same value.  check_merged = false skips the merged map
+  // lookups, for a diff already known to lie outside of it
+  size_t num_cells = std::min(summary.keys.size() / 3,
+                              std::min(summary.depths.size(), summary.log_odds.size()));
+  bool insert = true, duplicate = true;
+  for (size_t i = 0; i < num_cells && (insert || duplicate); i++) {
+    unsigned int depth = summary.depths[i];
+    OcTreeKey key(summary.keys[3 * i], summary.keys[3 * i + 1], summary.keys[3 * i + 2]);
+    // search() takes depth 0 as the leaf level, so a whole-map leaf is mixed
+    if (depth == 0 || depth > merged->getTreeDepth() || footprint->search(key, depth)) {
+      insert = duplicate = false;
+      break;
+    }
+
+    OcTreeNodeOwned *node = check_merged ? merged->search(key, depth) : NULL;
+    if (node) insert = false;
+    if (!node || merged->nodeHasChildren(node) || std::isnan(summary.log_odds[i]) ||
+        node->getLogOdds() != summary.log_odds[i])
+      duplicate = false;
+  }
+
+  // Later diffs of the batch have to see all of this one's cells
+  for (size_t i = 0; i < num_cells; i++) {
+    OcTreeKey key(summary.keys[3 * i], summary.keys[3 * i + 1], summary.keys[3 * i + 2]);
+    footprint->setNodeValueAtDepth(key, std::min<unsigned int>(summary.depths[i],
+                                                               footprint->getTreeDepth()),
+                                   0, true);
+  }
+
+  if (duplicate) return OVERLAP_DUPLICATE;
+  return insert ? OVERLAP_INSERT : OVERLAP_MIXED;
 }
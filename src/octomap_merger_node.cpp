@@ -1,5 +1,6 @@
 #include <octomap_merger.h>
 #include <chrono>
+#include <iterator>
 
 OctomapMerger::OctomapMerger(ros::NodeHandle* nodehandle):nh_(*nodehandle) {
     ROS_INFO("Constructing OctomapMerger Class");
@@ -13,164 +14,1498 @@ OctomapMerger::OctomapMerger(ros::NodeHandle* nodehandle):nh_(*nodehandle) {
     nh_.param(nn + "/octoType", octo_type, 0);
     // Map resolution
     nh_.param(nn + "/resolution", resolution, (double)0.2);
-    // Map size threshold to trigger a map merge
-    nh_.param(nn + "/mapThresh", map_thresh, 50);
+    // Changed volume (m^3) that triggers a diff, and the longest any change waits
+    nh_.param(nn + "/diffMinVolume", diff_min_volume, (double)0.4);
+    nh_.param(nn + "/diffMaxInterval", diff_max_interval, (double)30);
+    // Link budget for publishing diffs in bytes/s (0 = unlimited) and burst size in bytes
+    nh_.param(nn + "/diffBandwidth", diff_bandwidth, (double)0);
+    nh_.param(nn + "/diffBurst", diff_burst, (double)65536);
+    // Fold diffs still waiting for the link into one diff
+    nh_.param(nn + "/diffCoalesce", diff_coalesce, true);
+    // Diffs per published page
+    nh_.param(nn + "/diffPageSize", diff_page_size, 50);
+    // Seconds before a page asked of its owner and not received is asked again
+    nh_.param(nn + "/pageRequestTimeout", page_request_timeout, (double)5);
+    // Number of recently received diffs remembered to drop relayed copies
+    nh_.param(nn + "/dedupWindow", dedup_window, 4096);
+    // Neighbor messages queued before the oldest is dropped unread
+    nh_.param(nn + "/neighborQueueSize", neighbor_queue_size, 10);
+    // Own-map stage rate, and the neighbor worker's rate, batch size (diffs
+    // per cycle, 0 = all) and nice value
+    nh_.param(nn + "/rate", rate, (double)1.0);
+    nh_.param(nn + "/neighborRate", neighbor_rate, (double)0.1);
+    nh_.param(nn + "/neighborBatch", neighbor_batch, 20);
+    nh_.param(nn + "/neighborNice", neighbor_nice, 10);
+    // Threads decoding and merging neighbor diffs (0 = one per core), and the
+    // comma separated CPUs to pin them to (empty = no pinning)
+    nh_.param(nn + "/mergeThreads", merge_threads, 0);
+    nh_.param<std::string>(nn + "/mergeAffinity", merge_affinity, "");
+    // Depth of the regions neighbor diffs are split into for merging, and
+    // the message bytes below which diffs are decoded together in one task
+    nh_.param(nn + "/mergeTaskDepth", merge_task_depth, 8);
+    nh_.param(nn + "/mergeTaskBytes", merge_task_bytes, 65536);
+    // Depth of the merged map subtrees that get their own write lock, and
+    // the number of locks they share (1 = merge tasks take turns)
+    nh_.param(nn + "/stripeDepth", stripe_depth, 8);
+    nh_.param(nn + "/mergeStripes", merge_stripes, 1024);
+    // While at least this many neighbor diffs wait (a restart, or a peer's
+    // whole history), merge that many per cycle, combined pairwise on the
+    // merge threads first (0 = off)
+    nh_.param(nn + "/bootstrapBatch", bootstrap_batch, 256);
+    // Depth down to which each sent diff's overlap summary lists the cells
+    // it touches (0 = send none)
+    nh_.param(nn + "/summaryDepth", summary_depth, 10);
+    // Seconds a peer's reported load keeps slowing our diffs
+    nh_.param(nn + "/backpressureTimeout", backpressure_timeout, (double)30);
+    // Also exchange diffs as OctomapArray and OctomapNeighbors on the
+    // original topics, for peers that do not read pages
+    nh_.param(nn + "/legacySchema", legacy_schema, true);
+    // Send each diff in chunks: occupied voxels and free blocks down to
+    // chunkCoarseDepth first, then finer free space, chunkMaxLeaves per chunk
+    nh_.param(nn + "/diffProgressive", diff_progressive, false);
+    nh_.param(nn + "/chunkCoarseDepth", chunk_coarse_depth, 12);
+    nh_.param(nn + "/chunkMaxLeaves", chunk_max_leaves, 2000);
+    // Log-odds change needed to resend a voxel that stayed free or occupied (0 = any change)
+    nh_.param(nn + "/diffThresh", diff_thresh, (double)0);
+    // Keep per-owner layers so a neighbor can be dropped and re-merged
+    nh_.param(nn + "/provenanceLayers", provenance_layers, false);
+    // Number of re-anchored diffs to re-merge each cycle
+    nh_.param(nn + "/reanchorBudget", reanchor_budget, 5);
+    // Also publish the merged map as a deduplicated subtree DAG
+    nh_.param(nn + "/dagSnapshots", dag_snapshots, false);
+    // Merged map memory budget in MB (0 = unlimited).  Over budget, blocks
+    // farther than coarsenRadius are collapsed to coarsenDepth
+    nh_.param(nn + "/memoryBudget", memory_budget, (double)0);
+    nh_.param(nn + "/coarsenDepth", coarsen_depth, 13);
+    nh_.param(nn + "/coarsenRadius", coarsen_radius, (double)30);
+    // Spill tiles of the merged map that were not used for tileEvictAge
+    // seconds, or the least recently used past maxResidentTiles, to disk
+    nh_.param(nn + "/outOfCore", out_of_core, false);
+    nh_.param(nn + "/tileDepth", tile_depth, 10);
+    nh_.param(nn + "/tileEvictAge", tile_evict_age, (double)120);
+    nh_.param(nn + "/maxResidentTiles", max_resident_tiles, 4096);
+    nh_.param<std::string>(nn + "/tileStorePath", tile_store_path, "/tmp/" + id + "_tiles.bin");
+    // Send the merged map, DAG snapshots and diff pages larger than a chunk
+    // as checksummed chunks of transferChunkSize bytes, request chunks still
+    // missing after transferTimeout seconds and resend the ones peers ask
+    // for.  Partial payloads from peers take at most transferMaxBuffer
+    // bytes together
+    nh_.param(nn + "/chunkedTransfer", chunked_transfer, false);
+    nh_.param(nn + "/transferChunkSize", transfer_chunk_size, 16384);
+    nh_.param(nn + "/transferMaxBuffer", transfer_max_buffer, 64 * 1024 * 1024);
+    nh_.param(nn + "/transferTimeout", transfer_timeout, (double)5);
+    // Drop this fraction of outgoing chunks, to test resends without a real lossy link
+    nh_.param(nn + "/transferLossRate", transfer_loss_rate, (double)0);
+    // Exchange received-seq watermarks with peers and drop our diffs once
+    // every known peer (those that sent an ack, plus the comma separated
+    // diffAckPeers) or a base has them.  Dropped diffs are appended to
+    // diffArchivePath if set
+    nh_.param(nn + "/diffAcks", diff_acks, false);
+    nh_.param<std::string>(nn + "/diffAckPeers", diff_ack_peers, "");
+    nh_.param<std::string>(nn + "/diffArchivePath", diff_archive_path, "");
 
     // Topics for Subscribing and Publishing
     nh_.param<std::string>(nn + "/mapTopic", map_topic, "octomap_binary");
     nh_.param<std::string>(nn + "/neighborsTopic", neighbors_topic, "neighbor_maps");
     nh_.param<std::string>(nn + "/mergedTopic", merged_topic, "merged_map");
     nh_.param<std::string>(nn + "/mapDiffsTopic", map_diffs_topic, "map_diffs");
+    nh_.param<std::string>(nn + "/neighborPagesTopic", neighbor_pages_topic, "neighbor_map_pages");
+    nh_.param<std::string>(nn + "/mapDiffPagesTopic", map_diff_pages_topic, "map_diff_pages");
+    nh_.param<std::string>(nn + "/pageRequestsTopic", page_requests_topic, "diff_page_requests");
     nh_.param<std::string>(nn + "/numDiffsTopic", num_diffs_topic, "numDiffs");
     nh_.param<std::string>(nn + "/pclTopic", pcl_topic, "pc2_out");
+    nh_.param<std::string>(nn + "/dropOwnerTopic", drop_owner_topic, "drop_owner");
+    nh_.param<std::string>(nn + "/anchorTopic", anchor_topic, "anchor_updates");
+    nh_.param<std::string>(nn + "/dagTopic", dag_topic, "merged_map_dag");
+    nh_.param<std::string>(nn + "/odomTopic", odom_topic, "odometry");
+    nh_.param<std::string>(nn + "/chunksTopic", chunks_topic, "merged_map_chunks");
+    nh_.param<std::string>(nn + "/neighborChunksTopic", neighbor_chunks_topic, "neighbor_chunks");
+    nh_.param<std::string>(nn + "/missingChunksTopic", missing_chunks_topic, "missing_chunks");
+    nh_.param<std::string>(nn + "/neighborDagsTopic", neighbor_dags_topic, "neighbor_map_dags");
+    nh_.param<std::string>(nn + "/neighborMergedTopic", neighbor_merged_topic,
+                           "neighbor_merged_maps");
+    nh_.param<std::string>(nn + "/diffAcksTopic", diff_acks_topic, "diff_acks");
+    nh_.param<std::string>(nn + "/neighborAcksTopic", neighbor_acks_topic, "neighbor_diff_acks");
+    nh_.param<std::string>(nn + "/backpressureTopic", backpressure_topic, "merger_load");
+    nh_.param<std::string>(nn + "/neighborBackpressureTopic", neighbor_backpressure_topic, "neighbor_merger_load");
 
     initializeSubscribers();
     initializePublishers();
     myMapNew = false;
     otherMapsNew = false;
+    have_position = false;
+    peer_load = 1;
+    peer_load_time = 0;
 
     // Initialize Octomap holders once, assign/overwrite each loop
-    tree_merged = new octomap::OcTreeStamped(resolution);
+    tree_merged = new octomap::OcTreeOwned(resolution);
+    tree_merged->setStripes(stripe_depth, std::max(merge_stripes, 1));
     tree_sys = new octomap::OcTree(resolution);
-    tree_old = new octomap::OcTree(resolution);
-    tree_temp = new octomap::OcTree(resolution);
-    tree_diff = new octomap::OcTree(resolution);
+    tree_old = new octomap::OcTreeOwned(resolution);
+    tree_diff = new octomap::OcTreeOwned(resolution);
     num_diffs = 0;
+    mapdiffs.version = marble_octomap_merger::OctomapPage::VERSION;
+    mapdiffs.owner = id;
+    num_emitted = 0;
+    array_stale = false;
+    emitter = new DiffEmitter(diff_min_volume, diff_max_interval, diff_bandwidth, diff_burst);
+    layers = provenance_layers ? new ProvenanceLayers(resolution, id) : NULL;
+
+    chunk_sender = new ChunkSender(transfer_chunk_size, 16);
+    reassembler = new ChunkReassembler(16, std::max(transfer_max_buffer, 0));
+    lossy_link = new LossyLink(transfer_loss_rate);
+
+    std::stringstream peers(diff_ack_peers);
+    std::string peer;
+    while (std::getline(peers, peer, ','))
+      if (!peer.empty()) ack_peers.insert(peer);
+
+    own_backlog = new octomap::OcTreeOwned(resolution);
+    have_merged_bbx = false;
+    stop_worker = false;
+    merged_changed = false;
+
+    std::vector<int> cpus;
+    std::stringstream cpu_list(merge_affinity);
+    std::string cpu;
+    while (std::getline(cpu_list, cpu, ','))
+      if (!cpu.empty()) cpus.push_back(atoi(cpu.c_str()));
+    pool = new WorkPool(std::max(merge_threads, 0), cpus, neighbor_nice);
+
+    tiles = NULL;
+    if (out_of_core) {
+      tiles = new TileCache(tree_merged, tile_depth, tile_store_path,
+                            tile_evict_age, max_resident_tiles);
+      if (!tiles->isOpen()) {
+        ROS_ERROR("Unable to open tile store %s, keeping the merged map in memory",
+                  tile_store_path.data());
+        delete tiles;
+        tiles = NULL;
+      }
+    }
+
+    neighbor_worker = std::thread(&OctomapMerger::neighborLoop, this);
 }
 
 // Destructor
 OctomapMerger::~OctomapMerger() {
+  stop_worker = true;
+  if (neighbor_worker.joinable()) neighbor_worker.join();
+
+  delete pool;
+  delete own_backlog;
+  delete layers;
+  delete tiles;
+  delete emitter;
+  delete chunk_sender;
+  delete reassembler;
+  delete lossy_link;
+  for (size_t i = 0; i < pending_diffs.size(); i++)
+    delete pending_diffs[i].tree;
 }
 
 void OctomapMerger::initializeSubscribers() {
     ROS_INFO("Initializing Subscribers");
-    sub_mymap = nh_.subscribe(map_topic, 100,
+    // Only the newest own map matters, and dropped messages are never deserialized
+    sub_mymap = nh_.subscribe(map_topic, 1,
                               &OctomapMerger::callback_myMap, this);
-    sub_neighbors = nh_.subscribe(neighbors_topic, 100,
-                                  &OctomapMerger::callback_neighborMaps, this);
+    sub_backpressure = nh_.subscribe(neighbor_backpressure_topic, 10,
+                                     &OctomapMerger::callback_backpressure, this);
+
+    // Everything about other robots is handled by the neighbor worker
+    ros::NodeHandle nh_neighbors(nh_);
+    nh_neighbors.setCallbackQueue(&neighbor_queue);
+    sub_neighbor_pages = nh_neighbors.subscribe(neighbor_pages_topic, neighbor_queue_size,
+                                                &OctomapMerger::callback_neighborMaps, this);
+    sub_page_requests = nh_neighbors.subscribe(page_requests_topic, 100,
+                                               &OctomapMerger::callback_pageRequest, this);
+    if (legacy_schema)
+        sub_neighbors = nh_neighbors.subscribe(neighbors_topic, neighbor_queue_size,
+                                               &OctomapMerger::callback_legacyNeighborMaps, this);
+    if (provenance_layers)
+        sub_drop = nh_neighbors.subscribe(drop_owner_topic, 10,
+                                          &OctomapMerger::callback_dropOwner, this);
+    sub_anchor = nh_neighbors.subscribe(anchor_topic, 10,
+                                        &OctomapMerger::callback_anchor, this);
+    if (memory_budget > 0)
+        sub_odom = nh_neighbors.subscribe(odom_topic, 1,
+                                          &OctomapMerger::callback_odom, this);
+    if (chunked_transfer) {
+        sub_chunks = nh_neighbors.subscribe(neighbor_chunks_topic, 1000,
+                                            &OctomapMerger::callback_chunk, this);
+        sub_missing = nh_neighbors.subscribe(missing_chunks_topic, 100,
+                                             &OctomapMerger::callback_missingChunks, this);
+    }
+    if (diff_acks)
+        sub_acks = nh_neighbors.subscribe(neighbor_acks_topic, 100,
+                                          &OctomapMerger::callback_diffAck, this);
 }
 
 void OctomapMerger::initializePublishers() {
     ROS_INFO("Initializing Publishers");
     pub_merged = nh_.advertise<octomap_msgs::Octomap>(merged_topic, 1, true);
     pub_size = nh_.advertise<std_msgs::UInt32>(num_diffs_topic, 1, true);
-    pub_mapdiffs = nh_.advertise<marble_octomap_merger::OctomapArray>(map_diffs_topic, 1, true);
+    // Only the newest page is latched, late subscribers ask for the rest
+    pub_diff_pages = nh_.advertise<marble_octomap_merger::OctomapPage>(map_diff_pages_topic, 100, true);
+    pub_page_requests = nh_.advertise<marble_octomap_merger::PageRequest>(page_requests_topic, 100);
+    pub_backpressure = nh_.advertise<std_msgs::Float32>(backpressure_topic, 1, true);
+    if (legacy_schema)
+        pub_mapdiffs = nh_.advertise<marble_octomap_merger::OctomapArray>(map_diffs_topic, 1, true);
     if (type == "base")
         pub_pcl = nh_.advertise<sensor_msgs::PointCloud2>(pcl_topic, 1, true);
+    if (dag_snapshots)
+        pub_dag = nh_.advertise<marble_octomap_merger::OctomapDag>(dag_topic, 1, true);
+    if (chunked_transfer) {
+        pub_chunks = nh_.advertise<marble_octomap_merger::PayloadChunk>(chunks_topic, 1000);
+        pub_missing = nh_.advertise<marble_octomap_merger::MissingChunks>(missing_chunks_topic, 100);
+        pub_neighbor_dags = nh_.advertise<marble_octomap_merger::OctomapDag>(neighbor_dags_topic, 10);
+        pub_neighbor_merged = nh_.advertise<octomap_msgs::Octomap>(neighbor_merged_topic, 10);
+    }
+    if (diff_acks)
+        pub_acks = nh_.advertise<marble_octomap_merger::DiffAck>(diff_acks_topic, 1, true);
+}
+
+// Small per-agent id stored in each merged node; our own map is always 0
+uint8_t OctomapMerger::ownerId(const std::string& owner) {
+  if (owner == id) return 0;
+
+  std::map<std::string, uint8_t>::iterator it = owner_ids.find(owner);
+  if (it != owner_ids.end()) return it->second;
+
+  // Ids past the node's 8 bits all share the last one
+  uint8_t oid = std::min<size_t>(owner_ids.size() + 1, OcTreeNodeOwned::OWNER_MASK);
+  owner_ids[owner] = oid;
+  return oid;
+}
+
+octomap::OcTree* OctomapMerger::msgToMap(const octomap_msgs::Octomap& msg) {
+  if (octo_type == 0)
+    return (octomap::OcTree*)octomap_msgs::binaryMsgToMap(msg);
+  else
+    return (octomap::OcTree*)octomap_msgs::fullMsgToMap(msg);
+}
+
+const octomap_msgs::Octomap* OctomapMerger::findDiff(const std::string& owner, uint32_t seq) {
+  std::map<std::string, NeighborBuffer>::iterator it = neighbors.find(owner);
+  if (it == neighbors.end()) return NULL;
+  std::map<uint32_t, octomap_msgs::Octomap>::iterator diff = it->second.diffs.find(seq);
+  return (diff == it->second.diffs.end()) ? NULL : &diff->second;
+}
+
+// Latest anchor received for a diff, identity if it was never corrected
+Pose6D OctomapMerger::anchorFor(const std::string& owner, uint32_t seq) {
+  std::vector<AnchorRange>& ranges = anchors[owner];
+  for (int i = ranges.size() - 1; i >= 0; i--) {
+    if (seq >= ranges[i].seq_start && seq <= ranges[i].seq_end)
+      return ranges[i].anchor;
+  }
+  return Pose6D();
+}
+
+void OctomapMerger::reanchorDiff(const std::string& owner, uint32_t seq) {
+  const octomap_msgs::Octomap *diff = findDiff(owner, seq);
+  if (!diff) return;
+
+  Pose6D old_anchor;
+  std::map<uint32_t, Pose6D>::iterator it = applied_anchors[owner].find(seq);
+  if (it != applied_anchors[owner].end()) old_anchor = it->second;
+  Pose6D new_anchor = anchorFor(owner, seq);
+  if (old_anchor == new_anchor) return;
+
+  // Remove the voxels the diff produced in its stale frame
+  OcTree *stale = msgToMap(*diff);
+  if (!stale) return;
+  anchorTree(stale, old_anchor);
+  eraseLayered(owner, seq, stale);
+  delete stale;
+
+  // Re-insert it in the corrected frame; the composite catches up on refresh
+  OcTree *fixed = msgToMap(*diff);
+  anchorTree(fixed, new_anchor);
+  if (fixed->getRoot() != NULL) {
+    point3d min, max;
+    treeBBX(fixed, min, max);
+    growMergedBBX(min, max);
+  }
+  // It goes in as if merged now, with the overwrite flag it would get now
+  std::set<uint32_t>& merged = neighbors[owner].merged;
+  bool overwrite = merged.empty() || seq >= *merged.rbegin();
+  layer_stamps[owner][seq] = layers->insert(owner, ownerId(owner), fixed, overwrite, true);
+  delete fixed;
+
+  applied_anchors[owner][seq] = new_anchor;
+}
+
+void OctomapMerger::unmergeDiff(const std::string& owner, uint32_t seq) {
+  if (!layers) {
+    ROS_WARN("%s Diff %u from %s was replaced, its old voxels stay without provenanceLayers",
+             id.data(), seq, owner.data());
+    return;
+  }
+  const octomap_msgs::Octomap *diff = findDiff(owner, seq);
+  OcTree *old = diff ? msgToMap(*diff) : NULL;
+  if (!old) return;
+
+  // Take it out of the owner's layer in the frame it was merged in; the
+  // composite catches up on the next refresh
+  Pose6D anchor;
+  std::map<uint32_t, Pose6D>::iterator it = applied_anchors[owner].find(seq);
+  if (it != applied_anchors[owner].end()) {
+    anchor = it->second;
+    applied_anchors[owner].erase(it);
+  }
+  anchorTree(old, anchor);
+  {
+    std::lock_guard<std::mutex> lock(merged_mutex);
+    eraseLayered(owner, seq, old);
+  }
+  delete old;
+  otherMapsNew = true;
+}
+
+// Take a merged diff, decoded in the frame it was merged in, out of its
+// owner's layer by its stamp, so the owner's later diffs keep the voxels
+// they won.  The owner's other diffs overlapping it are written back with
+// their own stamps, refilling the voxels it had won from them.  Called
+// with merged_mutex held
+void OctomapMerger::eraseLayered(const std::string& owner, uint32_t seq, OcTree *diff) {
+  std::map<uint32_t, unsigned int>& stamps = layer_stamps[owner];
+  std::map<uint32_t, unsigned int>::iterator stamp = stamps.find(seq);
+  if (stamp == stamps.end()) return;
+  layers->erase(owner, diff, stamp->second);
+  stamps.erase(stamp);
+  if (diff->getRoot() == NULL) return;
+
+  point3d min, max;
+  treeBBX(diff, min, max);
+  NeighborBuffer& buffer = neighbors[owner];
+  std::map<uint32_t, Pose6D>& anchored = applied_anchors[owner];
+  for (stamp = stamps.begin(); stamp != stamps.end(); ++stamp) {
+    std::map<uint32_t, Pose6D>::iterator anchor = anchored.find(stamp->first);
+    Pose6D pose = (anchor != anchored.end()) ? anchor->second : Pose6D();
+
+    // Skip by summary where there is one: its box moved into our frame
+    std::map<uint32_t, marble_octomap_merger::DiffSummary>::iterator summary =
+        buffer.summaries.find(stamp->first);
+    if (summary != buffer.summaries.end()) {
+      point3d smin(1e9, 1e9, 1e9), smax(-1e9, -1e9, -1e9);
+      for (int c = 0; c < 8; c++) {
+        point3d corner = pose.transform(point3d(
+            (c & 1) ? summary->second.bbx_max[0] : summary->second.bbx_min[0],
+            (c & 2) ? summary->second.bbx_max[1] : summary->second.bbx_min[1],
+            (c & 4) ? summary->second.bbx_max[2] : summary->second.bbx_min[2]));
+        for (int a = 0; a < 3; a++) {
+          smin(a) = std::min(smin(a), corner(a));
+          smax(a) = std::max(smax(a), corner(a));
+        }
+      }
+      if (smin.x() > max.x() || smax.x() < min.x() || smin.y() > max.y() ||
+          smax.y() < min.y() || smin.z() > max.z() || smax.z() < min.z()) continue;
+    }
+
+    const octomap_msgs::Octomap *msg = findDiff(owner, stamp->first);
+    OcTree *other = msg ? msgToMap(*msg) : NULL;
+    if (!other) continue;
+    anchorTree(other, pose);
+    layers->restore(owner, ownerId(owner), other, stamp->second);
+    delete other;
+  }
 }
 
 // Callbacks
 void OctomapMerger::callback_myMap(const octomap_msgs::OctomapConstPtr& msg) {
-  myMap = *msg;
+  myMap = msg;
   myMapNew = true;
 }
 
 void OctomapMerger::callback_neighborMaps(
+                const marble_octomap_merger::OctomapPagesConstPtr& msg) {
+  if (msg->version > marble_octomap_merger::OctomapPages::VERSION)
+    ROS_WARN_ONCE("%s Neighbor pages use schema version %d, reading them as %d",
+                  id.data(), msg->version, marble_octomap_merger::OctomapPages::VERSION);
+  // Pages share the message, nothing is copied until mergeNeighbors() ingests them
+  for (int i=0; i < msg->pages.size(); i++)
+    queueNeighborPage(marble_octomap_merger::OctomapPageConstPtr(msg, &msg->pages[i]));
+  otherMapsNew = true;
+}
+
+void OctomapMerger::callback_legacyNeighborMaps(
                 const marble_octomap_merger::OctomapNeighborsConstPtr& msg) {
-  neighbors = *msg;
+  // Old peers' arrays become one page each.  Their counts may have wrapped,
+  // so only the array lengths are used.  Version 1 marks the page as
+  // converted: the array shows only the newest diffs, not the oldest held
+  for (int i=0; i < msg->neighbors.size(); i++) {
+    const marble_octomap_merger::OctomapArray& array = msg->neighbors[i];
+    if (array.octomaps.empty()) continue;
+
+    marble_octomap_merger::OctomapPagePtr page(new marble_octomap_merger::OctomapPage);
+    page->version = 1;
+    page->header = array.header;
+    page->owner = array.owner;
+    page->octomaps = array.octomaps;
+    page->seq_first = page->seq_oldest = array.octomaps.front().header.seq;
+    page->seq_last = array.octomaps.back().header.seq;
+    page->num_diffs = page->seq_last + 1;
+    for (int j=0; j < array.octomaps.size(); j++) {
+      page->emit_first.push_back(array.octomaps[j].header.seq);
+      page->emit_last.push_back(array.octomaps[j].header.seq);
+      page->content_hash.push_back(crc32(array.octomaps[j].data.data(),
+                                         array.octomaps[j].data.size()));
+    }
+    page->continuation = 0;
+    queueNeighborPage(page);
+  }
   otherMapsNew = true;
 }
 
-void OctomapMerger::merge() {
-  if (octo_type == 0)
-    tree_sys = (octomap::OcTree*)octomap_msgs::binaryMsgToMap(myMap);
+void OctomapMerger::queueNeighborPage(const marble_octomap_merger::OctomapPageConstPtr& page) {
+  // A newer copy of a page replaces the one still waiting
+  pending_pages[PageKey(page->owner, page->seq_first, page->seq_last)] = page;
+}
+
+void OctomapMerger::addNeighborPage(const marble_octomap_merger::OctomapPage& page) {
+  if (page.owner == id) return;
+  NeighborBuffer& buffer = neighbors[page.owner];
+
+  // Forget what the owner itself no longer holds, as the whole arrays did
+  // when each message replaced the last.  Converted arrays only show the
+  // newest diffs, so they leave that alone.  Forgotten diffs are no longer
+  // seen either, so a resend gets through
+  buffer.seq_end = std::max(buffer.seq_end, page.num_diffs);
+  if (page.version >= 2) {
+    buffer.paged = true;
+    buffer.seq_oldest = page.seq_oldest;
+    if (page.continuation) buffer.continuation = page.continuation;
+    std::map<uint32_t, uint32_t>::iterator old;
+    for (old = buffer.hashes.begin(); old != buffer.hashes.end() && old->first < page.seq_oldest;
+         ++old)
+      recently_seen.erase(SeenKey(page.owner, old->first, old->second));
+    buffer.diffs.erase(buffer.diffs.begin(), buffer.diffs.lower_bound(page.seq_oldest));
+    buffer.hashes.erase(buffer.hashes.begin(), buffer.hashes.lower_bound(page.seq_oldest));
+    buffer.summaries.erase(buffer.summaries.begin(),
+                           buffer.summaries.lower_bound(page.seq_oldest));
+    // Their voxels stay in the layer, with nothing left to restore them from
+    std::map<uint32_t, unsigned int>& stamps = layer_stamps[page.owner];
+    stamps.erase(stamps.begin(), stamps.lower_bound(page.seq_oldest));
+  }
+
+  // Pages are resent and relayed by several peers, so copies of diffs
+  // already seen or held are dropped before anything is copied
+  for (int j=0; j < page.octomaps.size(); j++) {
+    uint32_t seq = page.octomaps[j].header.seq;
+    uint32_t hash = (j < page.content_hash.size()) ? page.content_hash[j] : 0;
+    if (seq < buffer.seq_oldest) continue;
+    SeenKey key(page.owner, seq, hash);
+    if (hash && recently_seen.count(key)) continue;
+
+    std::map<uint32_t, uint32_t>::iterator held = buffer.hashes.find(seq);
+    if (held != buffer.hashes.end()) {
+      if (!hash || !held->second || held->second == hash) continue;
+      // Same seq, other content: the owner restarted its numbering.  What
+      // the old diff put in the merged map comes out before the new one goes
+      // in, and it is forgotten so that a resend of it replaces this one again
+      if (buffer.merged.erase(seq)) unmergeDiff(page.owner, seq);
+      recently_seen.erase(SeenKey(page.owner, seq, held->second));
+    }
+
+    buffer.diffs[seq] = page.octomaps[j];
+    buffer.hashes[seq] = hash;
+    if (j < page.summaries.size()) buffer.summaries[seq] = page.summaries[j];
+    else buffer.summaries.erase(seq);
+    if (seq < buffer.cursor) buffer.cursor = seq;
+
+    if (hash && recently_seen.insert(key).second) {
+      seen_order.push_back(key);
+      while (seen_order.size() > (size_t)std::max(dedup_window, 1)) {
+        recently_seen.erase(seen_order.front());
+        seen_order.pop_front();
+      }
+    }
+  }
+}
+
+void OctomapMerger::requestPages(double now) {
+  // Ask each owner for the page a received page continues at, or else for
+  // the first diff it still holds that we have neither received nor merged.
+  // Owners only heard on the original schema cannot answer
+  std::map<std::string, NeighborBuffer>::iterator it;
+  for (it = neighbors.begin(); it != neighbors.end(); ++it) {
+    NeighborBuffer& buffer = it->second;
+    if (!buffer.paged) continue;
+    if (buffer.continuation < buffer.seq_oldest || buffer.diffs.count(buffer.continuation) ||
+        buffer.merged.count(buffer.continuation))
+      buffer.continuation = 0;
+
+    uint32_t seq = buffer.continuation;
+    if (!seq) {
+      seq = buffer.seq_oldest;
+      while (seq < buffer.seq_end && (buffer.diffs.count(seq) || buffer.merged.count(seq)))
+        seq++;
+      if (seq >= buffer.seq_end) continue;
+    }
+    if (seq == buffer.requested && now - buffer.request_time < page_request_timeout) continue;
+
+    marble_octomap_merger::PageRequest msg;
+    msg.header.stamp = ros::Time::now();
+    msg.owner = it->first;
+    msg.seq = seq;
+    pub_page_requests.publish(msg);
+    buffer.requested = seq;
+    buffer.request_time = now;
+  }
+}
+
+void OctomapMerger::callback_pageRequest(const marble_octomap_merger::PageRequestConstPtr& msg) {
+  if (msg->owner != id) return;
+  std::lock_guard<std::mutex> lock(diffs_mutex);
+  page_requests.insert(msg->seq);
+}
+
+bool OctomapMerger::publishPage(size_t first, size_t last, bool charge, double now) {
+  // Callers hold diffs_mutex.  The page points at the seq the next one
+  // starts at, so a peer that asked for it can ask for that one next.
+  // Pages of diffs already charged one by one are not charged again
+  marble_octomap_merger::OctomapPage page;
+  page.version = marble_octomap_merger::OctomapPage::VERSION;
+  page.header.stamp = ros::Time::now();
+  page.owner = id;
+  page.octomaps.assign(mapdiffs.octomaps.begin() + first, mapdiffs.octomaps.begin() + last);
+  page.emit_first.assign(mapdiffs.emit_first.begin() + first, mapdiffs.emit_first.begin() + last);
+  page.emit_last.assign(mapdiffs.emit_last.begin() + first, mapdiffs.emit_last.begin() + last);
+  page.content_hash.assign(mapdiffs.content_hash.begin() + first,
+                           mapdiffs.content_hash.begin() + last);
+  if (mapdiffs.summaries.size() == mapdiffs.octomaps.size())
+    page.summaries.assign(mapdiffs.summaries.begin() + first, mapdiffs.summaries.begin() + last);
+  page.seq_first = page.octomaps.front().header.seq;
+  page.seq_last = page.octomaps.back().header.seq;
+  page.seq_oldest = mapdiffs.octomaps.front().header.seq;
+  page.num_diffs = num_diffs;
+  page.continuation = (last < mapdiffs.octomaps.size()) ? mapdiffs.octomaps[last].header.seq : 0;
+  uint32_t bytes = ros::serialization::serializationLength(page);
+  if (charge && !emitter->consume(bytes, now)) return false;
+  // Pages too large for one chunk go as chunks, so a lossy link resends
+  // only the lost pieces
+  if (chunked_transfer && bytes > (uint32_t)transfer_chunk_size)
+    sendPayload(page, marble_octomap_merger::PayloadChunk::KIND_DIFF_PAGE);
   else
-    tree_sys = (octomap::OcTree*)octomap_msgs::fullMsgToMap(myMap);
+    pub_diff_pages.publish(page);
+  return true;
+}
 
-  if (!tree_sys && (type == "robot")) return;
+void OctomapMerger::publishArray() {
+  // Callers hold diffs_mutex.  Peers on the original schema get the newest
+  // diffs its 8 bit count can address.  Each diff's array copy was charged
+  // when it was sent, so the array itself is not charged again
+  marble_octomap_merger::OctomapArray array;
+  array.header.stamp = ros::Time::now();
+  array.owner = id;
+  size_t first = mapdiffs.octomaps.size() - std::min<size_t>(mapdiffs.octomaps.size(), 255);
+  array.octomaps.assign(mapdiffs.octomaps.begin() + first, mapdiffs.octomaps.end());
+  array.num_octomaps = array.octomaps.size();
+  pub_mapdiffs.publish(array);
+  array_stale = false;
+}
 
-  // Get the diff tree from the current robot map and the last one saved
-  double num_nodes = build_diff_tree(tree_old, tree_sys, tree_diff);
-  octomap_msgs::Octomap msg;
+void OctomapMerger::callback_dropOwner(const std_msgs::String::ConstPtr& msg) {
+  // Un-merge the owner now; its held diffs are merged again next cycle
+  ROS_INFO("%s Dropping contribution from %s", id.data(), msg->data.data());
+  {
+    std::lock_guard<std::mutex> lock(merged_mutex);
+    layers->drop(msg->data);
+    layer_stamps.erase(msg->data);
+  }
+  NeighborBuffer& buffer = neighbors[msg->data];
+  buffer.merged.clear();
+  buffer.cursor = 0;
+  otherMapsNew = true;
+}
 
-  // If there are enough new nodes, save the robot map for next iter, and merge differences
-  if (num_nodes > map_thresh) {
-    tree_old->swapContent(*tree_sys);
-    merge_maps(tree_merged, tree_diff, true, false);
+void OctomapMerger::callback_anchor(const marble_octomap_merger::AnchorUpdateConstPtr& msg) {
+  AnchorRange range;
+  range.seq_start = msg->seq_start;
+  range.seq_end = msg->seq_end;
+  range.anchor = Pose6D(
+      octomath::Vector3(msg->transform.translation.x,
+                        msg->transform.translation.y,
+                        msg->transform.translation.z),
+      octomath::Quaternion(msg->transform.rotation.w,
+                           msg->transform.rotation.x,
+                           msg->transform.rotation.y,
+                           msg->transform.rotation.z));
+  anchors[msg->owner].push_back(range);
 
-    // Publish the diffs
-    tree_diff->prune();
-    num_diffs++;
-    if (octo_type == 0)
-      octomap_msgs::binaryMapToMsg(*tree_diff, msg);
-    else
-      octomap_msgs::fullMapToMsg(*tree_diff, msg);
+  // Without layers the anchor only applies to diffs merged from now on
+  if (!layers) {
+    ROS_WARN("%s Anchor update for %s needs provenanceLayers to correct merged diffs",
+             id.data(), msg->owner.data());
+    return;
+  }
+
+  // Queue the diffs already merged in the corrected range
+  std::set<uint32_t>& merged = neighbors[msg->owner].merged;
+  for (std::set<uint32_t>::iterator it = merged.lower_bound(range.seq_start);
+       it != merged.end() && *it <= range.seq_end; ++it)
+    reanchor_queue.push_back(std::make_pair(msg->owner, *it));
+  otherMapsNew = true;
+}
+
+void OctomapMerger::callback_odom(const nav_msgs::Odometry::ConstPtr& msg) {
+  position = point3d(msg->pose.pose.position.x,
+                     msg->pose.pose.position.y,
+                     msg->pose.pose.position.z);
+  have_position = true;
+}
+
+void OctomapMerger::callback_chunk(const marble_octomap_merger::PayloadChunkConstPtr& msg) {
+  if (msg->owner == id) return;
+
+  Chunk chunk;
+  chunk.epoch = msg->epoch;
+  chunk.kind = msg->kind;
+  chunk.payload_id = msg->payload_id;
+  chunk.index = msg->index;
+  chunk.num_chunks = msg->num_chunks;
+  chunk.payload_size = msg->payload_size;
+  chunk.offset = msg->offset;
+  chunk.payload_crc = msg->payload_crc;
+  chunk.crc = msg->crc;
+  chunk.data = msg->data;
+
+  std::vector<uint8_t> payload;
+  if (!reassembler->add(msg->owner, chunk, ros::Time::now().toSec(), payload)) return;
+
+  // Snapshots and merged maps are passed on as if received whole, pages
+  // are merged like those on the pages topic
+  try {
+    ros::serialization::IStream stream(payload.data(), payload.size());
+    if (msg->kind == marble_octomap_merger::PayloadChunk::KIND_DAG) {
+      marble_octomap_merger::OctomapDag dag_msg;
+      ros::serialization::deserialize(stream, dag_msg);
+      pub_neighbor_dags.publish(dag_msg);
+    } else if (msg->kind == marble_octomap_merger::PayloadChunk::KIND_MERGED_MAP) {
+      octomap_msgs::Octomap map_msg;
+      ros::serialization::deserialize(stream, map_msg);
+      pub_neighbor_merged.publish(map_msg);
+    } else if (msg->kind == marble_octomap_merger::PayloadChunk::KIND_DIFF_PAGE) {
+      marble_octomap_merger::OctomapPagePtr page(new marble_octomap_merger::OctomapPage);
+      ros::serialization::deserialize(stream, *page);
+      queueNeighborPage(page);
+      otherMapsNew = true;
+    }
+  } catch (ros::serialization::StreamOverrunException& e) {
+    ROS_WARN("%s Dropping malformed payload from %s", id.data(), msg->owner.data());
+  }
+}
+
+void OctomapMerger::callback_missingChunks(const marble_octomap_merger::MissingChunksConstPtr& msg) {
+  // Requests for chunks we sent before a restart name another epoch.  The
+  // epoch never changes, so it is read without the lock
+  if (msg->owner != id || msg->epoch != chunk_sender->epoch()) return;
+
+  // Payloads already released just can't be resent; a newer snapshot
+  // follows, and peers request released pages again by seq
+  std::lock_guard<std::mutex> lock(transfer_mutex);
+  uint32_t num_chunks = chunk_sender->numChunks(msg->payload_id);
+  for (size_t i = 0; i < std::min(msg->range_start.size(), msg->range_end.size()); i++) {
+    for (uint32_t c = msg->range_start[i]; c <= msg->range_end[i] && c < num_chunks; c++)
+      sendChunk(msg->payload_id, c);
+  }
+}
+
+template <class MSG>
+void OctomapMerger::sendPayload(const MSG& msg, uint8_t kind) {
+  // Called from both stages, so the sender is shared under transfer_mutex
+  std::vector<uint8_t> payload(ros::serialization::serializationLength(msg));
+  ros::serialization::OStream stream(payload.data(), payload.size());
+  ros::serialization::serialize(stream, msg);
+
+  std::lock_guard<std::mutex> lock(transfer_mutex);
+  uint32_t payload_id = chunk_sender->add(payload, kind);
+  for (uint32_t c = 0; c < chunk_sender->numChunks(payload_id); c++)
+    sendChunk(payload_id, c);
+}
+
+void OctomapMerger::sendChunk(uint32_t payload_id, uint32_t index) {
+  // Callers hold transfer_mutex
+  Chunk chunk;
+  if (!chunk_sender->chunk(payload_id, index, chunk)) return;
+  if (lossy_link->drop()) return;
+
+  marble_octomap_merger::PayloadChunk msg;
+  msg.header.stamp = ros::Time::now();
+  msg.owner = id;
+  msg.epoch = chunk.epoch;
+  msg.kind = chunk.kind;
+  msg.payload_id = chunk.payload_id;
+  msg.index = chunk.index;
+  msg.num_chunks = chunk.num_chunks;
+  msg.payload_size = chunk.payload_size;
+  msg.offset = chunk.offset;
+  msg.payload_crc = chunk.payload_crc;
+  msg.crc = chunk.crc;
+  msg.data.swap(chunk.data);
+  pub_chunks.publish(msg);
+}
+
+void OctomapMerger::requestMissingChunks(double now) {
+  if (!chunked_transfer) return;
+
+  std::vector<ChunkReassembler::Gaps> gaps;
+  reassembler->missing(now, transfer_timeout, gaps);
+  for (size_t i = 0; i < gaps.size(); i++) {
+    marble_octomap_merger::MissingChunks msg;
     msg.header.stamp = ros::Time::now();
-    msg.header.frame_id = "world";
-    msg.header.seq = num_diffs - 1;
+    msg.owner = gaps[i].owner;
+    msg.epoch = gaps[i].epoch;
+    msg.payload_id = gaps[i].payload_id;
+    for (size_t r = 0; r < gaps[i].ranges.size(); r++) {
+      msg.range_start.push_back(gaps[i].ranges[r].first);
+      msg.range_end.push_back(gaps[i].ranges[r].second);
+    }
+    pub_missing.publish(msg);
+  }
+}
+
+void OctomapMerger::callback_diffAck(const marble_octomap_merger::DiffAckConstPtr& msg) {
+  if (msg->sender == id) return;
+
+  PeerAck& ack = peer_acks[msg->sender];
+  ack.base = msg->base;
+  for (size_t i = 0; i < std::min(msg->owners.size(), msg->watermarks.size()); i++)
+    ack.watermarks[msg->owners[i]] = msg->watermarks[i];
+  ack_peers.insert(msg->sender);
+}
+
+void OctomapMerger::callback_backpressure(const std_msgs::Float32::ConstPtr& msg) {
+  // Follow the most loaded peer; a stale report gives way to any newer one
+  double now = ros::Time::now().toSec();
+  if (msg->data >= peer_load || now - peer_load_time > backpressure_timeout) {
+    peer_load = msg->data;
+    peer_load_time = now;
+  }
+}
+
+void OctomapMerger::publishAck() {
+  marble_octomap_merger::DiffAck ack;
+  ack.header.stamp = ros::Time::now();
+  ack.sender = id;
+  ack.base = (type == "base");
+
+  std::map<std::string, NeighborBuffer>::iterator it;
+  for (it = neighbors.begin(); it != neighbors.end(); ++it) {
+    // Diffs older than the owner still holds were dropped there already, so
+    // count from its oldest one to the first we have not merged
+    uint32_t watermark = it->second.seq_oldest;
+    while (it->second.merged.count(watermark)) watermark++;
+
+    ack.owners.push_back(it->first);
+    ack.watermarks.push_back(watermark);
+  }
+  pub_acks.publish(ack);
+}
+
+void OctomapMerger::trimDiffs() {
+  // Everything below the lowest watermark of the known peers is held by
+  // all of them; a base having it is enough on its own
+  uint32_t peers_have = 0, base_has = 0;
+  bool first = true;
+  for (std::set<std::string>::iterator p = ack_peers.begin(); p != ack_peers.end(); ++p) {
+    uint32_t watermark = 0;
+    std::map<std::string, PeerAck>::iterator ack = peer_acks.find(*p);
+    if (ack != peer_acks.end()) {
+      std::map<std::string, uint32_t>::iterator w = ack->second.watermarks.find(id);
+      if (w != ack->second.watermarks.end()) watermark = w->second;
+      if (ack->second.base) base_has = std::max(base_has, watermark);
+    }
+    peers_have = first ? watermark : std::min(peers_have, watermark);
+    first = false;
+  }
+  uint32_t trim_below = std::max(peers_have, base_has);
+
+  // The trimmed diffs are moved out under the lock and archived after it,
+  // so publishing never waits on the disk
+  std::vector<octomap_msgs::Octomap> trimmed;
+  {
+    std::lock_guard<std::mutex> lock(diffs_mutex);
+
+    size_t num_trim = 0;
+    while (num_trim < mapdiffs.octomaps.size() &&
+           mapdiffs.octomaps[num_trim].header.seq < trim_below)
+      num_trim++;
+    if (!num_trim) return;
 
-    // Add the diff to the map diffs array
+    if (!diff_archive_path.empty()) {
+      trimmed.assign(std::make_move_iterator(mapdiffs.octomaps.begin()),
+                     std::make_move_iterator(mapdiffs.octomaps.begin() + num_trim));
+    }
+
+    mapdiffs.octomaps.erase(mapdiffs.octomaps.begin(), mapdiffs.octomaps.begin() + num_trim);
+    mapdiffs.emit_first.erase(mapdiffs.emit_first.begin(),
+                              mapdiffs.emit_first.begin() + num_trim);
+    mapdiffs.emit_last.erase(mapdiffs.emit_last.begin(), mapdiffs.emit_last.begin() + num_trim);
+    mapdiffs.content_hash.erase(mapdiffs.content_hash.begin(),
+                                mapdiffs.content_hash.begin() + num_trim);
+    mapdiffs.summaries.erase(mapdiffs.summaries.begin(),
+                             mapdiffs.summaries.begin() +
+                             std::min(num_trim, mapdiffs.summaries.size()));
+    // Pages only carry new diffs, the array is republished with the next ones
+    array_stale = legacy_schema;
+  }
+  if (trimmed.empty()) return;
+
+  // Length prefixed serialized Octomap messages
+  std::ofstream archive(diff_archive_path.c_str(), std::ios::binary | std::ios::app);
+  for (size_t i = 0; i < trimmed.size(); i++) {
+    uint32_t size = ros::serialization::serializationLength(trimmed[i]);
+    std::vector<uint8_t> buffer(size);
+    ros::serialization::OStream stream(buffer.data(), size);
+    ros::serialization::serialize(stream, trimmed[i]);
+    archive.write((const char*)&size, sizeof(size));
+    archive.write((const char*)buffer.data(), size);
+  }
+  if (!archive)
+    ROS_WARN("%s Unable to archive diffs to %s", id.data(), diff_archive_path.data());
+}
+
+void OctomapMerger::enforceMemoryBudget() {
+  // Distance is measured from the robot, so wait for the first odometry
+  if (!have_position) return;
+
+  size_t budget = memory_budget * 1024 * 1024;
+  size_t used = tree_merged->memoryUsage();
+  if (used <= budget) return;
+
+  // Collapsed blocks come back to full resolution when new diffs touch them
+  size_t freed = tree_merged->coarsen(position, coarsen_radius, coarsen_depth, used - budget);
+  ROS_INFO("%s Merged map over budget (%zu kB), coarsened %zu kB", id.data(),
+           used / 1024, freed / 1024);
+}
+
+void OctomapMerger::splitPendingDiff() {
+  // Replace the front diff by its progressive chunks, occupied voxels first
+  PendingDiff pending = pending_diffs.front();
+  pending_diffs.pop_front();
+  std::vector<octomap::OcTreeOwned*> chunks;
+  split_diff(pending.tree, chunks, chunk_coarse_depth, chunk_max_leaves);
+  delete pending.tree;
+
+  for (int i = chunks.size() - 1; i >= 0; i--) {
+    if (chunks[i]->getRoot() == NULL) {
+      delete chunks[i];
+      continue;
+    }
+    PendingDiff entry;
+    entry.tree = chunks[i];
+    entry.chunk = true;
+    entry.emit_first = pending.emit_first;
+    entry.emit_last = pending.emit_last;
+    pending_diffs.push_front(entry);
+  }
+}
+
+void OctomapMerger::publishDiffs(double now) {
+  std::lock_guard<std::mutex> lock(diffs_mutex);
+  size_t page_size = std::max(diff_page_size, 1);
+
+  // Pages peers asked for, from the requested seq on, as the link budget
+  // allows.  Diffs since trimmed are skipped, the page tells the peer where
+  // our history starts
+  while (!page_requests.empty()) {
+    uint32_t seq = *page_requests.begin();
+    size_t first = 0;
+    while (first < mapdiffs.octomaps.size() && mapdiffs.octomaps[first].header.seq < seq)
+      first++;
+    if (first < mapdiffs.octomaps.size() &&
+        !publishPage(first, std::min(first + page_size, mapdiffs.octomaps.size()), true, now))
+      break;
+    page_requests.erase(page_requests.begin());
+  }
+
+  // Move queued diffs to the map diffs array as the link budget allows
+  size_t num_held = mapdiffs.octomaps.size();
+  bool diffs_added = false;
+  while (!pending_diffs.empty()) {
+    if (diff_progressive && !pending_diffs.front().chunk) splitPendingDiff();
+
+    PendingDiff& pending = pending_diffs.front();
+    octomap_msgs::Octomap& msg = pending.msg;
+    if (msg.data.empty()) {
+      if (octo_type == 0)
+        octomap_msgs::binaryMapToMsg(*pending.tree, msg);
+      else
+        octomap_msgs::fullMapToMsg(*pending.tree, msg);
+      msg.header.frame_id = "world";
+      pending.summary = marble_octomap_merger::DiffSummary();
+      if (summary_depth > 0)
+        summarize_diff(pending.tree, summary_depth, octo_type == 0, pending.summary);
+    }
+    // The diff goes out in a page with its summary, and on the original
+    // schema once more in the array below, which is not charged itself
+    size_t bytes = ros::serialization::serializationLength(msg);
+    if (legacy_schema) bytes *= 2;
+    if (summary_depth > 0) bytes += ros::serialization::serializationLength(pending.summary);
+    if (!emitter->consume(bytes, now)) break;
+
+    // Seqs are given out as diffs are sent, so chunks and coalesced diffs
+    // each take one and receivers always see them in order
+    msg.header.stamp = ros::Time::now();
+    msg.header.seq = num_diffs++;
     mapdiffs.octomaps.push_back(msg);
-    mapdiffs.num_octomaps = num_diffs;
-    pub_mapdiffs.publish(mapdiffs);
+    mapdiffs.emit_first.push_back(pending.emit_first);
+    mapdiffs.emit_last.push_back(pending.emit_last);
+    mapdiffs.content_hash.push_back(crc32(msg.data.data(), msg.data.size()));
+    if (summary_depth > 0) mapdiffs.summaries.push_back(pending.summary);
+    delete pending.tree;
+    pending_diffs.pop_front();
+    diffs_added = true;
+  }
+  if (diffs_added) array_stale = legacy_schema;
+  if (array_stale) publishArray();
+  if (!diffs_added) return;
+
+  // Only the new diffs go out as pages, each diff was charged above
+  for (size_t first = num_held; first < mapdiffs.octomaps.size(); first += page_size)
+    publishPage(first, std::min(first + page_size, mapdiffs.octomaps.size()), false, now);
+
+  // Publish the number of diffs so multi_agent doesn't have to subscribe to
+  // the whole map.  This counts every diff sent, including ones since dropped
+  std_msgs::UInt32 size_msg;
+  size_msg.data = num_diffs;
+  pub_size.publish(size_msg);
+}
+
+void OctomapMerger::flushOwnBacklog() {
+  // Callers hold merged_mutex and backlog_mutex
+  if (own_backlog->getRoot() == NULL) return;
+  if (tiles) tiles->touch(own_backlog, ros::Time::now().toSec());
+  point3d min, max;
+  treeBBX(own_backlog, min, max);
+  growMergedBBX(min, max);
+  merge_maps(tree_merged, own_backlog, true, false);
+  if (layers) layers->insert(id, 0, own_backlog, true);
+  own_backlog->clear();
+  merged_changed = true;
+}
+
+void OctomapMerger::growMergedBBX(const point3d& min, const point3d& max) {
+  // Callers hold merged_mutex
+  if (!have_merged_bbx) {
+    merged_min = min;
+    merged_max = max;
+    have_merged_bbx = true;
+    return;
+  }
+  for (unsigned int k = 0; k < 3; k++) {
+    merged_min(k) = std::min(merged_min(k), min(k));
+    merged_max(k) = std::max(merged_max(k), max(k));
+  }
+}
 
-    // Publish the number of diffs so multi_agent doesn't have to subscribe to the whole map
-    std_msgs::UInt32 size_msg;
-    size_msg.data = num_diffs;
-    pub_size.publish(size_msg);
+void OctomapMerger::mergeOwn() {
+  tree_sys = myMap ? msgToMap(*myMap) : NULL;
+  if (!tree_sys) return;
+
+  // Get the diff tree from the current robot map and the last one saved
+  double num_changed;
+  build_diff_tree(tree_old, tree_sys, tree_diff, diff_thresh, &num_changed);
+  double changed_volume = num_changed * pow(resolution, 3);
+  double now = ros::Time::now().toSec();
+
+  // Peers that fall behind slow down our diffs
+  emitter->setLoad((now - peer_load_time <= backpressure_timeout) ? peer_load : 1);
+
+  // If enough changed, or changes waited long enough, record them as sent
+  // for next iter and merge differences.  Otherwise they keep accumulating
+  if (emitter->ready(changed_volume, now)) {
+    // tree_old tracks what was sent, so changes held back by diffThresh keep
+    // accumulating against it until they are large enough
+    merge_maps(tree_old, tree_diff, true, false);
+    tree_old->pruneDirty();
+    emitter->emitted(now);
+
+    // Never wait for the neighbor worker: if it holds the merged map, the
+    // diff waits in the backlog until the next cycle or the worker's publish
+    {
+      std::lock_guard<std::mutex> backlog_lock(backlog_mutex);
+      merge_maps(own_backlog, tree_diff, true, false);
+      own_backlog->pruneDirty();
+      std::unique_lock<std::mutex> lock(merged_mutex, std::try_to_lock);
+      if (lock.owns_lock()) flushOwnBacklog();
+    }
+
+    // Queue the diff.  While the previous one is still unsent, fold this one
+    // into it instead, so a slow link carries fewer, larger diffs.  Chunks
+    // already split for sending are left alone
+    if (pending_diffs.empty() || !diff_coalesce || pending_diffs.back().chunk) {
+      PendingDiff entry;
+      entry.tree = new octomap::OcTreeOwned(resolution);
+      entry.chunk = false;
+      entry.emit_first = num_emitted;
+      pending_diffs.push_back(entry);
+    }
+    PendingDiff& pending = pending_diffs.back();
+    pending.emit_last = num_emitted++;
+    merge_maps(pending.tree, tree_diff, true, false);
+    pending.tree->pruneDirty();
+    pending.msg.data.clear();
+  } else {
+    std::lock_guard<std::mutex> backlog_lock(backlog_mutex);
+    if (own_backlog->getRoot() != NULL) {
+      std::unique_lock<std::mutex> lock(merged_mutex, std::try_to_lock);
+      if (lock.owns_lock()) flushOwnBacklog();
+    }
   }
 
+  publishDiffs(now);
+
   // Remove all of the nodes whether we used them or not, for the next iter
   tree_diff->clear();
+  delete tree_sys;
+}
+
+void OctomapMerger::neighborLoop() {
+  // Below the own-map stage, so local autonomy never waits on other robots
+  if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), neighbor_nice) != 0)
+    ROS_WARN("%s Unable to lower the neighbor worker's priority", id.data());
+
+  ros::Rate r(neighbor_rate);
+  while (ros::ok() && !stop_worker) {
+    neighbor_queue.callAvailable();
+    if (otherMapsNew || merged_changed) {
+      otherMapsNew = false;
+      mergeNeighbors();
+    }
+    requestMissingChunks(ros::Time::now().toSec());
+    requestPages(ros::Time::now().toSec());
+    // Work through a backlog without waiting, the lowered priority keeps it
+    // out of the own-map stage's way
+    if (!otherMapsNew) r.sleep();
+  }
+}
 
-  // Merge each neighbors' diff map to the merged map
-  bool overwrite_node;
-  for (int i=0; i < neighbors.num_neighbors; i++) {
-    std::string nid = neighbors.neighbors[i].owner;
-    // Check each diff for new ones to merge
-    for (int j=0; j < neighbors.neighbors[i].num_octomaps; j++) {
-      uint32_t cur_seq = neighbors.neighbors[i].octomaps[j].header.seq;
-      bool exists = std::count(seqs[nid.data()].cbegin(), seqs[nid.data()].cend(), cur_seq);
+void OctomapMerger::mergeNeighbors() {
+  ros::WallTime merge_start = ros::WallTime::now();
+
+  {
+    std::lock_guard<std::mutex> lock(merged_mutex);
+
+    // Move a bounded number of re-anchored diffs each cycle
+    for (int n=0; n < reanchor_budget && !reanchor_queue.empty(); n++) {
+      reanchorDiff(reanchor_queue.front().first, reanchor_queue.front().second);
+      reanchor_queue.pop_front();
+    }
+
+    // Recompute voxels left behind by dropped or re-anchored diffs before merging new data
+    if (layers && layers->dirty()) {
+      if (tiles) {
+        const std::vector<KeySet>& dirty_blocks = layers->dirtyBlocks();
+        for (unsigned int d = 0; d < dirty_blocks.size(); d++) {
+          const KeySet& blocks = dirty_blocks[d];
+          for (KeySet::const_iterator it = blocks.begin(); it != blocks.end(); ++it)
+            tiles->touch(*it, d, ros::Time::now().toSec());
+        }
+      }
+      layers->refresh(tree_merged);
+    }
+  }
+
+  // Only the newest copy of each queued page is copied into the buffers
+  std::map<PageKey, marble_octomap_merger::OctomapPageConstPtr>::iterator page;
+  for (page = pending_pages.begin(); page != pending_pages.end(); ++page)
+    addNeighborPage(*page->second);
+  pending_pages.clear();
+
+  // A large backlog is taken bootstrapBatch diffs at a time and reduced
+  size_t batch_limit = std::max(neighbor_batch, 0);
+  bool reduce = false;
+  std::map<std::string, NeighborBuffer>::iterator neighbor;
+  if (bootstrap_batch > 0) {
+    size_t waiting = 0;
+    for (neighbor = neighbors.begin(); neighbor != neighbors.end(); ++neighbor) {
+      NeighborBuffer& buffer = neighbor->second;
+      std::map<uint32_t, octomap_msgs::Octomap>::iterator diff;
+      for (diff = buffer.diffs.lower_bound(buffer.cursor);
+           diff != buffer.diffs.end() && waiting < (size_t)bootstrap_batch; ++diff)
+        if (!buffer.merged.count(diff->first)) waiting++;
+    }
+    if (waiting >= (size_t)bootstrap_batch) {
+      reduce = true;
+      if (batch_limit > 0) batch_limit = std::max(batch_limit, (size_t)bootstrap_batch);
+    }
+  }
+
+  // Pick the diffs to merge, at most neighborBatch per cycle so the merged
+  // map keeps being published.  Each cycle starts after the neighbor served
+  // last, so one neighbor's long backlog does not starve the others
+  std::vector<BatchDiff> batch;
+  neighbor = neighbors.upper_bound(last_served);
+  for (size_t n = 0; n < neighbors.size(); n++, ++neighbor) {
+    if (neighbor == neighbors.end()) neighbor = neighbors.begin();
+    std::string nid = neighbor->first;
+    NeighborBuffer& buffer = neighbor->second;
+    // Check only the diffs received since the last cycle
+    std::map<uint32_t, octomap_msgs::Octomap>::iterator diff;
+    for (diff = buffer.diffs.lower_bound(buffer.cursor); diff != buffer.diffs.end(); ++diff) {
+      if (batch_limit > 0 && batch.size() >= batch_limit) break;
+      uint32_t cur_seq = diff->first;
+      bool exists = buffer.merged.count(cur_seq);
 
       if (!exists) {
         // ROS_INFO("%s Merging neighbor %s seq %d", id.data(), nid.data(), cur_seq);
-        seqs[nid.data()].push_back(cur_seq);
-        if (octo_type == 0)
-          tree_temp = (octomap::OcTree*)octomap_msgs::binaryMsgToMap(neighbors.neighbors[i].octomaps[j]);
-        else
-          tree_temp = (octomap::OcTree*)octomap_msgs::fullMsgToMap(neighbors.neighbors[i].octomaps[j]);
+        buffer.merged.insert(cur_seq);
+
+        BatchDiff entry;
+        entry.owner = nid;
+        entry.owner_id = ownerId(nid);
+        entry.msg = &diff->second;
+        std::map<uint32_t, marble_octomap_merger::DiffSummary>::iterator summary =
+            buffer.summaries.find(cur_seq);
+        entry.summary = (summary != buffer.summaries.end()) ? &summary->second : NULL;
+        entry.overlap = OVERLAP_MIXED;
+        entry.tree = NULL;
+
+        // Bring the diff into the owner's corrected frame if it has one
+        entry.anchor = anchorFor(nid, cur_seq);
+        if (!(entry.anchor == Pose6D())) applied_anchors[nid][cur_seq] = entry.anchor;
 
         // TODO Still problem where only replacing, not merging.  If multiple neighbors see the same node, only the last one received gets used
         // If it's latest, merge and append.  If not, only append
-        if (cur_seq >= *std::max_element(seqs[nid.data()].cbegin(), seqs[nid.data()].cend()))
-          overwrite_node = true;
-        else
-          overwrite_node = false;
+        entry.overwrite = (cur_seq >= *buffer.merged.rbegin());
+        batch.push_back(entry);
+        last_served = nid;
+      }
+    }
+    if (diff != buffer.diffs.end()) {
+      // Out of budget, pick up here next cycle
+      buffer.cursor = diff->first;
+      otherMapsNew = true;
+    } else if (!buffer.diffs.empty()) {
+      buffer.cursor = buffer.diffs.rbegin()->first + 1;
+    }
+  }
+  if (!batch.empty()) classifyBatch(batch);
+  if (reduce) reduceBatch(batch);
+  else if (!batch.empty()) mergeBatch(batch);
+
+  // Tell peers what we hold, and drop our diffs every peer holds
+  if (diff_acks) {
+    publishAck();
+    trimDiffs();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(merged_mutex);
+    if (memory_budget > 0) enforceMemoryBudget();
+
+    // Evicted tiles stay in the published map as coarse placeholders
+    if (tiles) tiles->evict(ros::Time::now().toSec());
+  }
+
+  publishMerged();
 
-        // Merge neighbor map
-        merge_maps(tree_merged, tree_temp, false, overwrite_node);
+  // Keep cycling until the re-anchor backlog is drained
+  if (!reanchor_queue.empty()) otherMapsNew = true;
+
+  // Report load as merge time over the worker period, above 1 we fall behind
+  std_msgs::Float32 load_msg;
+  load_msg.data = (ros::WallTime::now() - merge_start).toSec() * neighbor_rate;
+  pub_backpressure.publish(load_msg);
+}
+
+void OctomapMerger::classifyBatch(std::vector<BatchDiff>& batch) {
+  // Sort out the diffs that need no per-voxel merge from their summaries:
+  // a diff outside the merged map's box is an insert without any lookup,
+  // otherwise each of its cells is checked at the summary depth
+  OcTreeOwned footprint(resolution);
+  std::lock_guard<std::mutex> lock(merged_mutex);
+  double now = ros::Time::now().toSec();
+  for (size_t i = 0; i < batch.size(); i++) {
+    BatchDiff& diff = batch[i];
+    // Without a summary, or moved by an anchor, nothing is known of where
+    // the diff goes, so neither it nor anything after it can be sorted out
+    if (!diff.summary || !(diff.anchor == Pose6D())) break;
+    const marble_octomap_merger::DiffSummary& summary = *diff.summary;
+
+    bool check_merged = have_merged_bbx;
+    for (unsigned int k = 0; k < 3 && check_merged; k++) {
+      if (summary.bbx_max[k] < merged_min(k) || summary.bbx_min[k] > merged_max(k))
+        check_merged = false;
+    }
+    if (check_merged && tiles) {
+      // Evicted tiles would only show their placeholders
+      for (size_t c = 0; c + 2 < summary.keys.size() && c / 3 < summary.depths.size(); c += 3)
+        tiles->touch(OcTreeKey(summary.keys[c], summary.keys[c + 1], summary.keys[c + 2]),
+                     summary.depths[c / 3], now);
+    }
+    diff.overlap = classify_diff(tree_merged, &footprint, summary, check_merged);
+  }
+}
 
-        // Free the memory before the next neighbor
-        delete tree_temp;
+void OctomapMerger::mergeBatch(std::vector<BatchDiff>& batch) {
+  // Decode on the pool.  Diffs below mergeTaskBytes share a task until
+  // their messages add up to that, so a burst of small diffs costs few tasks
+  size_t first = 0, bytes = 0;
+  for (size_t i = 0; i < batch.size(); i++) {
+    bytes += batch[i].msg->data.size();
+    if (bytes < (size_t)merge_task_bytes && i + 1 < batch.size()) continue;
+    pool->submit([this, &batch, first, i]() {
+      for (size_t j = first; j <= i; j++) {
+        // Duplicates are only needed for the provenance layers
+        if (batch[j].overlap == OVERLAP_DUPLICATE && !layers) continue;
+        batch[j].tree = msgToMap(*batch[j].msg);
+        if (batch[j].tree && !(batch[j].anchor == Pose6D()))
+          anchorTree(batch[j].tree, batch[j].anchor);
       }
+    });
+    first = i + 1;
+    bytes = 0;
+  }
+  pool->wait();
+
+  // Every diff is cut at the same depth, so the pieces of one region from
+  // all diffs end up in one task and are merged there in batch order, as
+  // the overwrite rules expect.  A leaf coarser than that depth is cut up
+  // too, so the depth is raised until none is cut into more than 512
+  unsigned int split_depth = std::min<unsigned int>(merge_task_depth, tree_merged->getTreeDepth());
+  for (size_t i = 0; i < batch.size(); i++) {
+    if (!batch[i].tree || batch[i].overlap != OVERLAP_MIXED) continue;
+    for (OcTree::tree_iterator it = batch[i].tree->begin_tree(split_depth),
+         end = batch[i].tree->end_tree(); it != end; ++it) {
+      if (it.isLeaf()) split_depth = std::min(split_depth, it.getDepth() + 3);
     }
   }
 
-  // For Base Station, convert to PCL before pruning and publish
-  // TODO need to publish just the diffs
-  if (type == "base") {
-    // tree_merged->expand();
-    sensor_msgs::PointCloud2 pcl;
-    PointCloud::Ptr occupiedCells(new PointCloud);
-    tree2PointCloud(tree_merged, *occupiedCells);
-    pcl::toROSMsg(*occupiedCells, pcl);
-    pcl.header.stamp = ros::Time::now();
-    pcl.header.frame_id = "world";
-    pub_pcl.publish(pcl);
+  std::unordered_map<OcTreeKey, std::vector<RegionPiece>, OcTreeKey::KeyHash> regions;
+  {
+    std::lock_guard<std::mutex> lock(merged_mutex);
+    double now = ros::Time::now().toSec();
+    for (size_t i = 0; i < batch.size(); i++) {
+      OcTree *tree = batch[i].tree;
+      if (!tree) continue;
+      if (layers) {
+        layer_stamps[batch[i].owner][batch[i].msg->header.seq] =
+            layers->insert(batch[i].owner, batch[i].owner_id, tree, batch[i].overwrite);
+      }
+      if (batch[i].overlap == OVERLAP_DUPLICATE || tree->getRoot() == NULL) continue;
+      if (tiles) tiles->touch(tree, now);
+      point3d min, max;
+      treeBBX(tree, min, max);
+      growMergedBBX(min, max);
+      if (batch[i].overlap == OVERLAP_INSERT) continue;
+
+      unsigned int tree_depth = tree->getTreeDepth();
+      for (OcTree::tree_iterator it = tree->begin_tree(split_depth), end = tree->end_tree();
+           it != end; ++it) {
+        if (it.getDepth() == split_depth) {
+          RegionPiece piece = {i, &(*it), 0};
+          regions[it.getKey()].push_back(piece);
+        } else if (it.isLeaf()) {
+          // Centers of the regions the leaf covers
+          unsigned int size = 1 << (tree_depth - it.getDepth());
+          unsigned int step = 1 << (tree_depth - split_depth);
+          unsigned int n = size / step;
+          OcTreeKey base = it.getKey();
+          for (unsigned int k = 0; k < 3; k++)
+            base[k] = base[k] - size / 2 + step / 2;
+          RegionPiece piece = {i, NULL, it->getLogOdds()};
+          for (unsigned int x = 0; x < n; x++)
+            for (unsigned int y = 0; y < n; y++)
+              for (unsigned int z = 0; z < n; z++)
+                regions[OcTreeKey(base[0] + x * step, base[1] + y * step,
+                                  base[2] + z * step)].push_back(piece);
+        }
+      }
+    }
   }
 
-  // Prune and publish the Octomap
-  tree_merged->prune();
-  if (octo_type == 0)
-    octomap_msgs::binaryMapToMsg(*tree_merged, msg);
-  else
-    octomap_msgs::fullMapToMsg(*tree_merged, msg);
-  msg.header.stamp = ros::Time::now();
-  msg.header.frame_id = "world";
-  msg.id = "OcTree"; // Required to convert OcTreeStamped into regular OcTree
+  // One merge task per region; a large diff spreads over many of them and
+  // idle threads steal them from the busy ones.  The tasks write to the
+  // merged map at the same time, each region under its stripe's lock, while
+  // this thread keeps everything else off the map
+  std::lock_guard<std::mutex> lock(merged_mutex);
+
+  // Inserts touch nothing the map or an earlier diff holds, so they go
+  // first and their summary cells are grafted whole; later diffs see them
+  for (size_t i = 0; i < batch.size(); i++) {
+    if (batch[i].overlap != OVERLAP_INSERT || !batch[i].tree) continue;
+    const BatchDiff *diff = &batch[i];
+    pool->submit([this, diff]() {
+      unsigned int depth = 0;
+      for (size_t k = 0; k < diff->summary->depths.size(); k++)
+        depth = std::max<unsigned int>(depth, diff->summary->depths[k]);
+      depth = std::min(depth, diff->tree->getTreeDepth());
+      graft_diff(tree_merged, diff->tree, depth, diff->overwrite, diff->owner_id);
+    });
+  }
+  pool->wait();
+
+  std::unordered_map<OcTreeKey, std::vector<RegionPiece>, OcTreeKey::KeyHash>::iterator region;
+  for (region = regions.begin(); region != regions.end(); ++region) {
+    OcTreeKey key = region->first;
+    const std::vector<RegionPiece> *pieces = &region->second;
+    pool->submit([this, &batch, key, pieces, split_depth]() {
+      for (size_t j = 0; j < pieces->size(); j++) {
+        const RegionPiece& piece = (*pieces)[j];
+        const BatchDiff& diff = batch[piece.diff];
+        // A region the map has nothing in takes the first subtree whole
+        if (piece.node) {
+          if (!tree_merged->graft(diff.tree, piece.node, key, split_depth, diff.owner_id,
+                                  false, true))
+            merge_subtree(tree_merged, diff.tree, piece.node, key, split_depth, false,
+                          diff.overwrite, diff.owner_id);
+        } else {
+          tree_merged->mergeNode(key, split_depth, piece.log_odds, false, diff.overwrite,
+                                 diff.owner_id);
+        }
+      }
+    });
+  }
+  pool->wait();
+  tree_merged->collectStripes();
+
+  // Free the decoded diffs
+  for (size_t i = 0; i < batch.size(); i++)
+    delete batch[i].tree;
+}
+
+void OctomapMerger::reduceBatch(std::vector<BatchDiff>& batch) {
+  // Decode on the pool, stamping every voxel with its diff's overwrite flag
+  std::vector<OcTreeOwned*> stamped(batch.size(), NULL);
+  for (size_t i = 0; i < batch.size(); i++) {
+    if (batch[i].overlap == OVERLAP_DUPLICATE && !layers) continue;
+    pool->submit([this, &batch, &stamped, i]() {
+      OcTree *tree = msgToMap(*batch[i].msg);
+      if (!tree) return;
+      if (!(batch[i].anchor == Pose6D())) anchorTree(tree, batch[i].anchor);
+      stamped[i] = new OcTreeOwned(resolution);
+      merge_maps(stamped[i], tree, batch[i].overwrite, false, batch[i].owner_id);
+      stamped[i]->pruneDirty();
+      delete tree;
+    });
+  }
+  pool->wait();
+
+  if (layers) {
+    std::lock_guard<std::mutex> lock(merged_mutex);
+    for (size_t i = 0; i < batch.size(); i++)
+      if (stamped[i]) {
+        layer_stamps[batch[i].owner][batch[i].msg->header.seq] =
+            layers->insert(batch[i].owner, batch[i].owner_id, stamped[i], batch[i].overwrite);
+      }
+  }
+
+  // Duplicates would not change the merged map
+  for (size_t i = 0; i < batch.size(); i++) {
+    if (batch[i].overlap != OVERLAP_DUPLICATE) continue;
+    delete stamped[i];
+    stamped[i] = NULL;
+  }
+
+  // Combine neighbors pairwise in log2(n) rounds, the pairs of a round in
+  // parallel.  The earlier diff of a pair is always the target, so the
+  // batch order the overwrite rules depend on is kept
+  for (size_t step = 1; step < stamped.size(); step *= 2) {
+    for (size_t i = 0; i + step < stamped.size(); i += 2 * step) {
+      pool->submit([&stamped, i, step]() {
+        if (!stamped[i]) {
+          std::swap(stamped[i], stamped[i + step]);
+        } else if (stamped[i + step]) {
+          combine_stamped(stamped[i], stamped[i + step]);
+          delete stamped[i + step];
+          stamped[i + step] = NULL;
+        }
+      });
+    }
+    pool->wait();
+  }
+  OcTreeOwned *combined = stamped.empty() ? NULL : stamped[0];
+  if (!combined) return;
+
+  // Its regions are disjoint, so each is merged in a task of its own.  A
+  // leaf coarser than the regions covers none of them and is merged here
+  std::lock_guard<std::mutex> lock(merged_mutex);
+  if (tiles) tiles->touch(combined, ros::Time::now().toSec());
+  if (combined->getRoot() != NULL) {
+    point3d min, max;
+    treeBBX(combined, min, max);
+    growMergedBBX(min, max);
+  }
+  unsigned int split_depth = std::min<unsigned int>(merge_task_depth, tree_merged->getTreeDepth());
+  for (OcTreeOwned::tree_iterator it = combined->begin_tree(split_depth),
+       end = combined->end_tree(); it != end; ++it) {
+    if (it.getDepth() == split_depth) {
+      const OcTreeNodeOwned *node = &(*it);
+      OcTreeKey key = it.getKey();
+      pool->submit([this, combined, node, key, split_depth]() {
+        merge_stamped(tree_merged, combined, node, key, split_depth);
+      });
+    } else if (it.isLeaf()) {
+      tree_merged->mergeNode(it.getKey(), it.getDepth(), it->getLogOdds(), false, it->isOwn(),
+                             it->getOwnerId());
+    }
+  }
+  pool->wait();
+  tree_merged->collectStripes();
+
+  delete combined;
+}
+
+void OctomapMerger::publishMerged() {
+  octomap_msgs::Octomap msg;
+  marble_octomap_merger::OctomapDag dag_msg;
+  {
+    std::lock_guard<std::mutex> lock(merged_mutex);
+    {
+      // Own diffs the own-map stage could not merge while we held the map
+      std::lock_guard<std::mutex> backlog_lock(backlog_mutex);
+      flushOwnBacklog();
+    }
+    merged_changed = false;
+
+    // For Base Station, convert to PCL before pruning and publish
+    // TODO need to publish just the diffs
+    if (type == "base") {
+      // tree_merged->expand();
+      sensor_msgs::PointCloud2 pcl;
+      PointCloud::Ptr occupiedCells(new PointCloud);
+      tree2PointCloud(tree_merged, *occupiedCells);
+      pcl::toROSMsg(*occupiedCells, pcl);
+      pcl.header.stamp = ros::Time::now();
+      pcl.header.frame_id = "world";
+      pub_pcl.publish(pcl);
+    }
+
+    // Prune what changed this cycle and serialize the Octomap
+    tree_merged->pruneDirty();
+    if (octo_type == 0)
+      octomap_msgs::binaryMapToMsg(*tree_merged, msg);
+    else
+      octomap_msgs::fullMapToMsg(*tree_merged, msg);
+    msg.header.stamp = ros::Time::now();
+    msg.header.frame_id = "world";
+
+    // Same snapshot with identical subtrees shared, for constrained links
+    if (dag_snapshots) {
+      SubtreeDag dag;
+      dag.build(*tree_merged);
+      std::stringstream datastream;
+      dag.write(datastream);
+      std::string data = datastream.str();
+
+      dag_msg.header = msg.header;
+      dag_msg.owner = id;
+      dag_msg.resolution = resolution;
+      dag_msg.data.assign(data.begin(), data.end());
+    }
+  }
   pub_merged.publish(msg);
+  if (dag_snapshots) pub_dag.publish(dag_msg);
 
-  delete tree_sys;
+  // Peers get the snapshots in chunks, so a lossy link only resends gaps
+  if (chunked_transfer) {
+    sendPayload(msg, marble_octomap_merger::PayloadChunk::KIND_MERGED_MAP);
+    if (dag_snapshots) sendPayload(dag_msg, marble_octomap_merger::PayloadChunk::KIND_DAG);
+  }
 }
 
 int main (int argc, char **argv) {
@@ -179,19 +1514,23 @@ int main (int argc, char **argv) {
 
   double rate;
   std::string nn = ros::this_node::getName();
-  nh.param(nn + "/rate", rate, (double)0.1);
+  nh.param(nn + "/rate", rate, (double)1.0);
 
+  // Neighbor merging runs in its own worker, this loop is only the own map
   OctomapMerger *octomap_merger = new OctomapMerger(&nh);
 
   ros::Rate r(rate);
   while(nh.ok()) {
     ros::spinOnce();
-    if(octomap_merger->myMapNew || octomap_merger->otherMapsNew) {
+    if(octomap_merger->myMapNew) {
       octomap_merger->myMapNew = false;
-      octomap_merger->otherMapsNew = false;
-      octomap_merger->merge();
+      octomap_merger->mergeOwn();
+    } else {
+      // Diffs held back by the link budget go out without a new map
+      octomap_merger->publishDiffs(ros::Time::now().toSec());
     }
     r.sleep();
   }
+  delete octomap_merger;
   return 0;
 }
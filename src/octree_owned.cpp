@@ -0,0 +1,423 @@
+#include <octree_owned.h>
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+namespace octomap {
+
+OcTreeOwned::OcTreeOwned(double resolution)
+  : OccupancyOcTreeBase<OcTreeNodeOwned>(resolution), stripe_depth(0) {
+}
+
+OcTreeOwned::~OcTreeOwned() {
+  for (size_t i = 0; i < stripes.size(); i++)
+    delete stripes[i];
+}
+
+OcTreeNodeOwned* OcTreeOwned::setNodeValueAtDepth(const OcTreeKey& key, unsigned int depth,
+                                                  float log_odds, bool lazy_eval) {
+  OcTreeNodeOwned *path[17];
+  bool created = false;
+
+  if (root == NULL) {
+    root = new OcTreeNodeOwned();
+    tree_size++;
+    size_changed = true;
+    created = true;
+  }
+
+  OcTreeNodeOwned *node = root;
+  for (unsigned int d = 0; d < depth; d++) {
+    path[d] = node;
+    unsigned int pos = computeChildIdx(key, tree_depth - 1 - d);
+    if (!nodeChildExists(node, pos)) {
+      // A pruned leaf keeps its value in the siblings it expands into
+      if (!nodeHasChildren(node) && !created) {
+        expandNode(node);
+      } else {
+        createNodeChild(node, pos);
+        created = true;
+      }
+    }
+    node = getNodeChild(node, pos);
+  }
+
+  deleteChildren(node);
+  node->setLogOdds(log_odds);
+
+  if (!lazy_eval) {
+    for (int d = depth - 1; d >= 0; d--)
+      path[d]->updateOccupancyChildren();
+  }
+
+  return node;
+}
+
+void OcTreeOwned::mergeNode(const OcTreeKey& key, unsigned int depth, float log_odds,
+                            bool replace, bool overwrite, uint8_t owner) {
+  OcTreeNodeOwned *node;
+  unsigned int node_depth;
+  Stripe *stripe = lockSubtree(key, depth, node, node_depth);
+
+  long num_nodes = 0;
+  bool created = false;
+  if (node == NULL) {
+    root = new OcTreeNodeOwned();
+    num_nodes++;
+    node = root;
+    created = true;
+  }
+
+  if (mergeFrom(node, node_depth, key, depth, log_odds, replace, overwrite, owner, created,
+                num_nodes))
+    markDirty(stripe, key);
+  unlockSubtree(stripe, num_nodes);
+}
+
+bool OcTreeOwned::graft(OcTree *source, OcTreeNode *node, const OcTreeKey& key,
+                        unsigned int depth, uint8_t owner, bool own, bool move) {
+  OcTreeNodeOwned *parent;
+  unsigned int parent_depth;
+  Stripe *stripe = lockSubtree(key, depth, parent, parent_depth);
+
+  long num_nodes = 0;
+  bool created = false;
+  if (parent == NULL && depth > 0) {
+    root = new OcTreeNodeOwned();
+    num_nodes++;
+    parent = root;
+    created = true;
+  }
+
+  bool grafted = false;
+  if (parent == NULL) {
+    root = graftRecurs(source, node, owner, own, move, num_nodes);
+    grafted = true;
+  } else if (parent_depth < depth) {
+    // Down to the region's parent, unless a coarser leaf already covers it
+    unsigned int d = parent_depth;
+    for (; d + 1 < depth; d++) {
+      unsigned int pos = computeChildIdx(key, tree_depth - 1 - d);
+      if (!nodeChildExists(parent, pos)) {
+        if (!nodeHasChildren(parent) && !created) break;
+        addChild(parent, pos, num_nodes);
+        created = true;
+      }
+      parent = getNodeChild(parent, pos);
+    }
+
+    if (d + 1 == depth && (nodeHasChildren(parent) || created)) {
+      unsigned int pos = computeChildIdx(key, tree_depth - depth);
+      if (!nodeChildExists(parent, pos)) {
+        parent->setChild(pos, graftRecurs(source, node, owner, own, move, num_nodes));
+        grafted = true;
+      }
+    }
+  }
+
+  if (grafted) markDirty(stripe, key);
+  unlockSubtree(stripe, num_nodes);
+  return grafted;
+}
+
+// Child slots of a decoded OcTree's nodes.  The member is protected, but a
+// pointer to it taken through a derived class is not
+struct ChildSlots : public OcTreeNode {
+  static AbstractOcTreeNode** OcTreeDataNode<float>::* member() { return &ChildSlots::children; }
+};
+
+OcTreeNodeOwned* OcTreeOwned::graftRecurs(OcTree *source, OcTreeNode *node, uint8_t owner,
+                                          bool own, bool move, long& num_nodes) {
+  OcTreeNodeOwned *copy = new OcTreeNodeOwned();
+  num_nodes++;
+  copy->setLogOdds(node->getLogOdds());
+  copy->setOwner(owner, own);
+  if (!source->nodeHasChildren(node)) return copy;
+
+  if (move) {
+    // The slot array changes hands, each child is converted into its own
+    // slot and freed, which leaves node a leaf of the source
+    AbstractOcTreeNode **slots = node->*ChildSlots::member();
+    node->*ChildSlots::member() = NULL;
+    for (unsigned int i = 0; i < 8; i++) {
+      if (slots[i] == NULL) continue;
+      OcTreeNode *child = static_cast<OcTreeNode*>(slots[i]);
+      slots[i] = graftRecurs(source, child, owner, own, move, num_nodes);
+      delete child;
+    }
+    copy->adoptChildren(slots);
+  } else {
+    for (unsigned int i = 0; i < 8; i++) {
+      if (source->nodeChildExists(node, i))
+        copy->setChild(i, graftRecurs(source, source->getNodeChild(node, i), owner, own, move,
+                                      num_nodes));
+    }
+  }
+
+  copy->updateOccupancyChildren();
+  return copy;
+}
+
+OcTreeOwned::Stripe* OcTreeOwned::lockSubtree(const OcTreeKey& key, unsigned int depth,
+                                              OcTreeNodeOwned*& node,
+                                              unsigned int& node_depth) {
+  if (!stripes.empty() && depth >= stripe_depth) {
+    // The subtree's coordinates at the stripe depth, mixed (Fibonacci
+    // hashing) so nearby subtrees spread over every stripe.  KeyHash of the
+    // adjusted key would keep its constant low bits and use only a few
+    unsigned int shift = tree_depth - stripe_depth;
+    uint64_t h = ((uint64_t)(key[0] >> shift) << 32) | ((uint64_t)(key[1] >> shift) << 16) |
+                 (key[2] >> shift);
+    h *= 0x9e3779b97f4a7c15ULL;
+    Stripe *stripe = stripes[(h >> 32) % stripes.size()];
+    stripe->mutex.lock();
+
+    // Nothing above an existing subtree changes, so only its stripe is needed
+    node = root;
+    for (unsigned int d = 0; node && d < stripe_depth; d++) {
+      unsigned int pos = computeChildIdx(key, tree_depth - 1 - d);
+      node = nodeChildExists(node, pos) ? getNodeChild(node, pos) : NULL;
+    }
+    if (node) {
+      node_depth = stripe_depth;
+      return stripe;
+    }
+    stripe->mutex.unlock();
+  }
+
+  // Coarse writes and new subtrees change shared nodes: hold every stripe
+  for (size_t i = 0; i < stripes.size(); i++)
+    stripes[i]->mutex.lock();
+  node = root;
+  node_depth = 0;
+  return NULL;
+}
+
+void OcTreeOwned::unlockSubtree(Stripe *stripe, long num_nodes) {
+  if (stripe) {
+    stripe->num_nodes += num_nodes;
+    stripe->mutex.unlock();
+    return;
+  }
+
+  tree_size += num_nodes;
+  size_changed = true;
+  for (size_t i = 0; i < stripes.size(); i++)
+    stripes[i]->mutex.unlock();
+}
+
+void OcTreeOwned::markDirty(Stripe *stripe, const OcTreeKey& key) {
+  if (stripe)
+    stripe->dirty_keys.insert(adjustKeyAtDepth(key, tree_depth - 1));
+  else
+    markDirty(key);
+}
+
+bool OcTreeOwned::mergeFrom(OcTreeNodeOwned *node, unsigned int node_depth,
+                            const OcTreeKey& key, unsigned int depth, float log_odds,
+                            bool replace, bool overwrite, uint8_t owner, bool created,
+                            long& num_nodes) {
+  for (unsigned int d = node_depth; d < depth; d++) {
+    unsigned int pos = computeChildIdx(key, tree_depth - 1 - d);
+    if (!nodeChildExists(node, pos)) {
+      if (!nodeHasChildren(node) && !created) {
+        // A uniform block coarser than the source: if the rules keep it,
+        // they keep all of it, so there is no need to expand
+        if (!(replace || (overwrite && !node->isOwn()))) return false;
+        expandLeaf(node, num_nodes);
+      } else {
+        addChild(node, pos, num_nodes);
+        created = true;
+      }
+    }
+    node = getNodeChild(node, pos);
+  }
+
+  if (created) {
+    // Absent region: a single node at the source's depth
+    node->setLogOdds(log_odds);
+    node->setOwner(owner, replace);
+  } else {
+    mergeRecurs(node, log_odds, replace, overwrite, owner, num_nodes);
+  }
+  return true;
+}
+
+void OcTreeOwned::mergeRecurs(OcTreeNodeOwned *node, float log_odds, bool replace,
+                              bool overwrite, uint8_t owner, long& num_nodes) {
+  if (!nodeHasChildren(node)) {
+    if (replace || (overwrite && !node->isOwn())) {
+      node->setLogOdds(log_odds);
+      node->setOwner(owner, replace);
+    }
+    return;
+  }
+
+  // Existing children follow the rules, missing ones are new and always set
+  for (unsigned int i = 0; i < 8; i++) {
+    if (nodeChildExists(node, i)) {
+      mergeRecurs(getNodeChild(node, i), log_odds, replace, overwrite, owner, num_nodes);
+    } else {
+      OcTreeNodeOwned *child = addChild(node, i, num_nodes);
+      child->setLogOdds(log_odds);
+      child->setOwner(owner, replace);
+    }
+  }
+
+  if (!pruneLeafs(node, num_nodes)) node->updateOccupancyChildren();
+}
+
+OcTreeNodeOwned* OcTreeOwned::addChild(OcTreeNodeOwned *node, unsigned int pos,
+                                       long& num_nodes) {
+  OcTreeNodeOwned *child = new OcTreeNodeOwned();
+  node->setChild(pos, child);
+  num_nodes++;
+  return child;
+}
+
+void OcTreeOwned::expandLeaf(OcTreeNodeOwned *node, long& num_nodes) {
+  for (unsigned int i = 0; i < 8; i++)
+    addChild(node, i, num_nodes)->copyData(*node);
+}
+
+bool OcTreeOwned::pruneLeafs(OcTreeNodeOwned *node, long& num_nodes) {
+  if (!isNodeCollapsible(node)) return false;
+
+  node->copyData(*getNodeChild(node, 0));
+  for (unsigned int i = 0; i < 8; i++)
+    delete getNodeChild(node, i);
+  node->releaseChildren();
+  num_nodes -= 8;
+  return true;
+}
+
+void OcTreeOwned::setStripes(unsigned int depth, unsigned int num_stripes) {
+  collectStripes();
+  for (size_t i = 0; i < stripes.size(); i++)
+    delete stripes[i];
+  stripes.clear();
+
+  stripe_depth = std::min(depth, tree_depth);
+  for (unsigned int i = 0; i < num_stripes; i++)
+    stripes.push_back(new Stripe);
+}
+
+void OcTreeOwned::collectStripes() {
+  for (size_t i = 0; i < stripes.size(); i++) {
+    Stripe *stripe = stripes[i];
+    if (stripe->num_nodes == 0 && stripe->dirty_keys.empty()) continue;
+    tree_size += stripe->num_nodes;
+    stripe->num_nodes = 0;
+    dirty_keys.insert(stripe->dirty_keys.begin(), stripe->dirty_keys.end());
+    stripe->dirty_keys.clear();
+    size_changed = true;
+  }
+}
+
+void OcTreeOwned::deleteChildren(OcTreeNodeOwned *node) {
+  if (nodeHasChildren(node)) {
+    for (unsigned int i = 0; i < 8; i++) {
+      if (nodeChildExists(node, i)) {
+        deleteChildren(getNodeChild(node, i));
+        deleteNodeChild(node, i);
+      }
+    }
+  }
+  node->releaseChildren();
+}
+
+void OcTreeOwned::pruneDirty() {
+  OcTreeNodeOwned *path[17];
+
+  collectStripes();
+
+  for (KeySet::iterator it = dirty_keys.begin(); root && it != dirty_keys.end(); ++it) {
+    // Walk down to the parent of the written voxels, or to where the path ends
+    unsigned int n = 0;
+    OcTreeNodeOwned *node = root;
+    path[n++] = node;
+    for (int i = tree_depth - 1; i > 0; i--) {
+      unsigned int pos = computeChildIdx(*it, i);
+      if (!nodeChildExists(node, pos)) break;
+      node = getNodeChild(node, pos);
+      path[n++] = node;
+    }
+
+    // Bottom-up: once a node cannot be pruned none of its ancestors can,
+    // but they still need their occupancy refreshed
+    bool prunable = true;
+    for (int d = n - 1; d >= 0; d--) {
+      if (!nodeHasChildren(path[d])) continue;
+      if (prunable) prunable = pruneNode(path[d]);
+      if (!prunable) path[d]->updateOccupancyChildren();
+    }
+  }
+
+  dirty_keys.clear();
+}
+
+size_t OcTreeOwned::coarsen(const point3d& center, double radius, unsigned int depth,
+                            size_t bytes_to_free) {
+  // Blocks at the coarse depth that still hold finer structure
+  struct Block {
+    double dist;
+    OcTreeKey key;
+    OcTreeNodeOwned *node;
+  };
+  std::vector<Block> blocks;
+  for (tree_iterator it = begin_tree(depth), end = end_tree(); it != end; ++it) {
+    if (it.getDepth() != depth || !nodeHasChildren(&(*it))) continue;
+    double dist = (it.getCoordinate() - center).norm();
+    if (dist > radius) {
+      Block block = {dist, it.getKey(), &(*it)};
+      blocks.push_back(block);
+    }
+  }
+  std::sort(blocks.begin(), blocks.end(),
+            [](const Block& a, const Block& b) { return a.dist < b.dist; });
+
+  size_t freed = 0;
+  for (int i = blocks.size() - 1; i >= 0 && freed < bytes_to_free; i--) {
+    freed += collapse(blocks[i].node);
+    markDirty(blocks[i].key);
+  }
+
+  return freed;
+}
+
+size_t OcTreeOwned::collapse(OcTreeNodeOwned *node) {
+  size_t freed = 0;
+  collapseRecurs(node, freed);
+  return freed;
+}
+
+bool OcTreeOwned::collapseRecurs(OcTreeNodeOwned *node, size_t& freed) {
+  if (!nodeHasChildren(node)) return true;
+
+  bool known = true;
+  for (unsigned int i = 0; i < 8; i++) {
+    if (!nodeChildExists(node, i)) known = false;
+    else if (!collapseRecurs(getNodeChild(node, i), freed)) known = false;
+  }
+  // Unknown space stays unknown: its known siblings were collapsed on their own
+  if (!known) return false;
+
+  // Conservative: the block is as occupied as its most occupied voxel, and
+  // only stays our own if all of it is, so neighbors can still write over
+  // what they sent
+  float max_log_odds = -std::numeric_limits<float>::max();
+  bool own = true;
+  for (unsigned int i = 0; i < 8; i++) {
+    OcTreeNodeOwned *child = getNodeChild(node, i);
+    max_log_odds = std::max(max_log_odds, child->getLogOdds());
+    own = own && child->isOwn();
+    deleteNodeChild(node, i);
+  }
+  node->releaseChildren();
+  node->setLogOdds(max_log_odds);
+  node->setOwn(own);
+  freed += 8 * sizeof(OcTreeNodeOwned) + 8 * sizeof(AbstractOcTreeNode*);
+  return true;
+}
+
+} // namespace octomap
@@ -0,0 +1,206 @@
+#include <provenance_layers.h>
+
+bool LayerTree::wins(unsigned int stamp, unsigned int best) {
+  bool overwrite = stamp & 1, best_overwrite = best & 1;
+  if (overwrite != best_overwrite) return overwrite;
+  // Of two diffs that could overwrite the later wins, of two others the earlier
+  return overwrite ? (stamp >> 1) > (best >> 1) : (stamp >> 1) < (best >> 1);
+}
+
+void LayerTree::writeBlock(const OcTreeKey& key, unsigned int depth, float log_odds,
+                           unsigned int stamp) {
+  bool created = false;
+  if (root == NULL) {
+    root = new OcTreeNodeStamped();
+    tree_size++;
+    size_changed = true;
+    created = true;
+  }
+
+  OcTreeNodeStamped *node = root;
+  for (unsigned int d = 0; d < depth; d++) {
+    unsigned int pos = computeChildIdx(key, tree_depth - 1 - d);
+    if (!nodeChildExists(node, pos)) {
+      // A coarser block keeps its value in the siblings it splits into,
+      // and is left whole if it wins over the write
+      if (!nodeHasChildren(node) && !created) {
+        if (!wins(stamp, node->getTimestamp())) return;
+        expandNode(node);
+      } else {
+        createNodeChild(node, pos);
+        created = true;
+      }
+    }
+    node = getNodeChild(node, pos);
+  }
+  writeRecurs(node, created, log_odds, stamp);
+}
+
+void LayerTree::writeRecurs(OcTreeNodeStamped *node, bool created, float log_odds,
+                            unsigned int stamp) {
+  if (!nodeHasChildren(node)) {
+    if (created || wins(stamp, node->getTimestamp())) {
+      node->setLogOdds(log_odds);
+      node->setTimestamp(stamp);
+    }
+    return;
+  }
+
+  // Finer structure: each part is decided on its own, and the gaps are absent
+  for (unsigned int i = 0; i < 8; i++) {
+    if (nodeChildExists(node, i)) {
+      writeRecurs(getNodeChild(node, i), false, log_odds, stamp);
+    } else {
+      OcTreeNodeStamped *child = createNodeChild(node, i);
+      child->setLogOdds(log_odds);
+      child->setTimestamp(stamp);
+    }
+  }
+}
+
+bool LayerTree::eraseBlock(const OcTreeKey& key, unsigned int depth, unsigned int stamp) {
+  if (root == NULL) return false;
+
+  std::vector<OcTreeNodeStamped*> path(1, root);
+  for (unsigned int d = 0; d < depth; d++) {
+    OcTreeNodeStamped *node = path.back();
+    if (!nodeHasChildren(node)) {
+      // A coarser block is only split if the erased block is part of it
+      if (node->getTimestamp() != stamp) return false;
+      expandNode(node);
+    }
+    unsigned int pos = computeChildIdx(key, tree_depth - 1 - d);
+    if (!nodeChildExists(node, pos)) return false;
+    path.push_back(getNodeChild(node, pos));
+  }
+
+  bool erased = false;
+  if (!eraseRecurs(path.back(), stamp, erased)) return erased;
+
+  // Delete the emptied block and the parents it leaves without children
+  for (unsigned int d = depth; d > 0; d--) {
+    deleteNodeChild(path[d - 1], computeChildIdx(key, tree_depth - d));
+    if (nodeHasChildren(path[d - 1])) return true;
+  }
+  clear();
+  return true;
+}
+
+// Returns whether node is left empty and should be deleted
+bool LayerTree::eraseRecurs(OcTreeNodeStamped *node, unsigned int stamp, bool& erased) {
+  if (!nodeHasChildren(node)) {
+    if (node->getTimestamp() != stamp) return false;
+    erased = true;
+    return true;
+  }
+  for (unsigned int i = 0; i < 8; i++) {
+    if (nodeChildExists(node, i) && eraseRecurs(getNodeChild(node, i), stamp, erased))
+      deleteNodeChild(node, i);
+  }
+  return !nodeHasChildren(node);
+}
+
+ProvenanceLayers::ProvenanceLayers(double resolution, const std::string& self)
+  : resolution(resolution), self(self), next_stamp(0) {
+  dirty_blocks.resize(OcTreeStamped(resolution).getTreeDepth() + 1);
+}
+
+ProvenanceLayers::~ProvenanceLayers() {
+  for (std::map<std::string, Layer>::iterator it = layers.begin(); it != layers.end(); ++it)
+    delete it->second.tree;
+}
+
+bool ProvenanceLayers::dirty() const {
+  for (size_t d = 0; d < dirty_blocks.size(); d++)
+    if (!dirty_blocks[d].empty()) return true;
+  return false;
+}
+
+OcTreeStamped* ProvenanceLayers::layer(const std::string& owner) {
+  std::map<std::string, Layer>::iterator it = layers.find(owner);
+  return (it != layers.end()) ? it->second.tree : NULL;
+}
+
+LayerTree* ProvenanceLayers::layerFor(const std::string& owner, uint8_t owner_id) {
+  std::map<std::string, Layer>::iterator lit = layers.find(owner);
+  if (lit == layers.end()) {
+    Layer l = { new LayerTree(resolution), owner_id };
+    lit = layers.insert(std::make_pair(owner, l)).first;
+  }
+  return lit->second.tree;
+}
+
+void ProvenanceLayers::drop(const std::string& owner) {
+  std::map<std::string, Layer>::iterator lit = layers.find(owner);
+  if (lit == layers.end()) return;
+
+  LayerTree *tree = lit->second.tree;
+  for (LayerTree::leaf_iterator it = tree->begin_leafs(); it != tree->end_leafs(); ++it)
+    dirty_blocks[it.getDepth()].insert(it.getKey());
+
+  delete tree;
+  layers.erase(lit);
+}
+
+void ProvenanceLayers::refresh(OcTreeOwned *composite) {
+  for (unsigned int d = 0; d < dirty_blocks.size(); d++) {
+    for (KeySet::iterator it = dirty_blocks[d].begin(); it != dirty_blocks[d].end(); ++it)
+      refreshBlock(composite, *it, d);
+    dirty_blocks[d].clear();
+  }
+}
+
+// search() treats depth 0 as the leaf level, so the root is handled here
+static OcTreeNodeStamped* blockAt(OcTreeStamped *tree, const OcTreeKey& key,
+                                  unsigned int depth) {
+  return (depth == 0) ? tree->getRoot() : tree->search(key, depth);
+}
+
+void ProvenanceLayers::refreshBlock(OcTreeOwned *composite, const OcTreeKey& key,
+                                    unsigned int depth) {
+  // Same rules as merge_maps(): our own layer always wins.  Of the neighbor
+  // layers, the latest diff that could overwrite wins, and if none could,
+  // the earliest, which found the voxel absent.  Each layer holds the block
+  // as one leaf, lacks it, or has finer structure in it; only the last
+  // splits the block
+  std::map<std::string, Layer>::iterator own = layers.find(self);
+  OcTreeNodeStamped *found = NULL;
+  std::map<std::string, Layer>::iterator src = layers.end();
+  bool split = (depth == 0), own_found = false;
+
+  if (!split && own != layers.end()) {
+    found = blockAt(own->second.tree, key, depth);
+    if (found) {
+      src = own;
+      own_found = true;
+      split = own->second.tree->nodeHasChildren(found);
+    }
+  }
+  for (std::map<std::string, Layer>::iterator it = layers.begin();
+       !split && !own_found && it != layers.end(); ++it) {
+    if (it == own) continue;
+    OcTreeNodeStamped *node = blockAt(it->second.tree, key, depth);
+    if (!node) continue;
+    if (it->second.tree->nodeHasChildren(node)) {
+      split = true;
+    } else if (!found || LayerTree::wins(node->getTimestamp(), found->getTimestamp())) {
+      found = node;
+      src = it;
+    }
+  }
+
+  if (split) {
+    unsigned int center_offset = (1 << (composite->getTreeDepth() - 1)) >> (depth + 1);
+    for (unsigned int i = 0; i < 8; i++) {
+      OcTreeKey child_key;
+      computeChildKey(i, center_offset, key, child_key);
+      refreshBlock(composite, child_key, depth + 1);
+    }
+  } else if (found) {
+    OcTreeNodeOwned *node = composite->setNodeValueAtDepth(key, depth, found->getLogOdds(), true);
+    node->setOwner(src->second.id, src == own);
+    composite->markDirty(key);
+  } else {
+    composite->deleteNode(key, depth);
+  }
+}
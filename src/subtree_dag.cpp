@@ -0,0 +1,206 @@
+#include <subtree_dag.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+
+const uint32_t SubtreeDag::NONE;
+const unsigned int SubtreeDag::MAX_DEPTH;
+
+static void writeVarint(std::ostream& s, uint32_t v) {
+  while (v >= 0x80) {
+    s.put((char)((v & 0x7f) | 0x80));
+    v >>= 7;
+  }
+  s.put((char)v);
+}
+
+static bool readVarint(std::istream& s, uint32_t& v) {
+  v = 0;
+  for (unsigned int shift = 0; shift < 35; shift += 7) {
+    int c = s.get();
+    if (c == EOF) return false;
+    v |= (uint32_t)(c & 0x7f) << shift;
+    if (!(c & 0x80)) return true;
+  }
+  return false;
+}
+
+// Bytes left to read, which bounds every count a stream can hold.  A
+// stream that cannot tell counts as empty
+static size_t remaining(std::istream& s) {
+  std::streampos pos = s.tellg();
+  if (pos < 0) return 0;
+  s.seekg(0, std::ios::end);
+  std::streampos end = s.tellg();
+  s.seekg(pos);
+  return (end > pos) ? (size_t)(end - pos) : 0;
+}
+
+// search() treats depth 0 as the leaf level, so the root is handled here
+static OcTreeNodeOwned* nodeAt(OcTreeOwned *tree, const OcTreeKey& key, unsigned int depth) {
+  return (depth == 0) ? tree->getRoot() : tree->search(key, depth);
+}
+
+void SubtreeDag::clear() {
+  root = NONE;
+  nodes.clear();
+  edges.clear();
+  index.clear();
+}
+
+size_t SubtreeDag::memoryUsage() const {
+  return sizeof(SubtreeDag) + nodes.capacity() * sizeof(Node) +
+         edges.capacity() * sizeof(uint32_t);
+}
+
+uint32_t SubtreeDag::intern(float log_odds, bool own, uint8_t mask, const uint32_t *children) {
+  // Content key: value bits, flags and child ids
+  unsigned int n = __builtin_popcount(mask);
+  std::string key(6 + 4 * n, '\0');
+  memcpy(&key[0], &log_odds, 4);
+  key[4] = own;
+  key[5] = mask;
+  if (n) memcpy(&key[6], children, 4 * n);
+
+  std::unordered_map<std::string, uint32_t>::iterator it = index.find(key);
+  if (it != index.end()) return it->second;
+
+  Node node;
+  node.log_odds = log_odds;
+  node.mask = mask;
+  node.own = own;
+  node.first_child = edges.size();
+  edges.insert(edges.end(), children, children + n);
+
+  uint32_t id = nodes.size();
+  nodes.push_back(node);
+  index[key] = id;
+  return id;
+}
+
+void SubtreeDag::toTree(OcTreeOwned *tree) const {
+  key_type center = 1 << (tree->getTreeDepth() - 1);
+  OcTreeKey root_key(center, center, center);
+  toTree(tree, root_key, 0);
+}
+
+void SubtreeDag::toTree(OcTreeOwned *tree, const OcTreeKey& key, unsigned int depth) const {
+  if (root == NONE) return;
+  toTreeRecurs(tree, root, key, depth);
+
+  // Only the path above the placed subtree needs its occupancy updated
+  for (int d = depth - 1; d >= 0; d--) {
+    OcTreeNodeOwned *node = nodeAt(tree, key, d);
+    if (node) node->updateOccupancyChildren();
+  }
+}
+
+void SubtreeDag::toTreeRecurs(OcTreeOwned *tree, uint32_t id, const OcTreeKey& key,
+                              unsigned int depth) const {
+  const Node& node = nodes[id];
+
+  // Shared subtrees are written out once per place they occur.  read()
+  // bounds the height, this only guards a DAG placed too deep
+  if (!node.mask || depth >= tree->getTreeDepth()) {
+    OcTreeNodeOwned *leaf = tree->setNodeValueAtDepth(key, depth, node.log_odds, true);
+    leaf->setOwn(node.own);
+    return;
+  }
+
+  unsigned int center_offset = (1 << (tree->getTreeDepth() - 1)) >> (depth + 1);
+  uint32_t edge = node.first_child;
+  for (unsigned int i = 0; i < 8; i++) {
+    if (!(node.mask & (1 << i))) continue;
+    OcTreeKey child_key;
+    computeChildKey(i, center_offset, key, child_key);
+    toTreeRecurs(tree, edges[edge++], child_key, depth + 1);
+  }
+
+  OcTreeNodeOwned *inner = nodeAt(tree, key, depth);
+  if (inner) inner->updateOccupancyChildren();
+}
+
+void SubtreeDag::write(std::ostream& s) const {
+  s.write("ODAG", 4);
+  s.write((const char*)&resolution, sizeof(resolution));
+
+  // Binary maps only hold a couple of distinct log-odds, so index a value table
+  std::map<float, uint32_t> values;
+  for (size_t i = 0; i < nodes.size(); i++)
+    values.insert(std::make_pair(nodes[i].log_odds, 0));
+  writeVarint(s, values.size());
+  uint32_t vi = 0;
+  for (std::map<float, uint32_t>::iterator it = values.begin(); it != values.end(); ++it) {
+    it->second = vi++;
+    s.write((const char*)&it->first, sizeof(float));
+  }
+
+  // Children always precede their parents, so store them as backwards deltas
+  writeVarint(s, nodes.size());
+  writeVarint(s, root == NONE ? 0 : root + 1);
+  for (size_t i = 0; i < nodes.size(); i++) {
+    const Node& node = nodes[i];
+    writeVarint(s, (values[node.log_odds] << 1) | (node.own ? 1 : 0));
+    s.put((char)node.mask);
+    unsigned int n = __builtin_popcount(node.mask);
+    for (unsigned int c = 0; c < n; c++)
+      writeVarint(s, i - edges[node.first_child + c]);
+  }
+}
+
+bool SubtreeDag::read(std::istream& s) {
+  clear();
+
+  char magic[4];
+  s.read(magic, 4);
+  if (!s || strncmp(magic, "ODAG", 4) != 0) return false;
+  s.read((char*)&resolution, sizeof(resolution));
+
+  // Counts come from the stream, so nothing is allocated before they are
+  // checked against what it holds: 4 bytes per value, at least 2 per node
+  uint32_t num_values;
+  if (!s || !readVarint(s, num_values) || num_values > remaining(s) / sizeof(float))
+    return false;
+  std::vector<float> values(num_values);
+  for (uint32_t i = 0; i < num_values; i++)
+    s.read((char*)&values[i], sizeof(float));
+  if (!s) return false;
+
+  uint32_t num_nodes, root_plus;
+  if (!readVarint(s, num_nodes) || !readVarint(s, root_plus) || num_nodes > remaining(s) / 2)
+    return false;
+  nodes.reserve(num_nodes);
+  // Levels below each node, so no subtree goes deeper than a tree can
+  std::vector<uint8_t> heights;
+  heights.reserve(num_nodes);
+  for (uint32_t i = 0; i < num_nodes; i++) {
+    uint32_t v, delta;
+    int mask = 0;
+    if (!readVarint(s, v) || (mask = s.get()) == EOF || (v >> 1) >= num_values) {
+      clear();
+      return false;
+    }
+
+    Node node;
+    node.log_odds = values[v >> 1];
+    node.own = v & 1;
+    node.mask = mask;
+    node.first_child = edges.size();
+    unsigned int n = __builtin_popcount(node.mask);
+    uint8_t height = 0;
+    for (unsigned int c = 0; c < n; c++) {
+      if (!readVarint(s, delta) || delta == 0 || delta > i ||
+          heights[i - delta] >= MAX_DEPTH) {
+        clear();
+        return false;
+      }
+      edges.push_back(i - delta);
+      height = std::max<uint8_t>(height, heights[i - delta] + 1);
+    }
+    nodes.push_back(node);
+    heights.push_back(height);
+  }
+
+  root = (root_plus && root_plus <= num_nodes) ? root_plus - 1 : NONE;
+  return true;
+}
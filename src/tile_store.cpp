@@ -0,0 +1,246 @@
+#include <tile_store.h>
+#include <subtree_dag.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <limits>
+#include <sstream>
+
+TileStore::TileStore(const std::string& path)
+  : path(path), mapped(NULL), mapped_size(0), end(0), stop(false) {
+  // The store only lives for this run, so start from an empty file
+  fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd >= 0) writer = std::thread(&TileStore::writeLoop, this);
+}
+
+TileStore::~TileStore() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  cond.notify_one();
+  if (writer.joinable()) writer.join();
+
+  if (mapped) munmap(mapped, mapped_size);
+  if (fd >= 0) {
+    close(fd);
+    unlink(path.c_str());
+  }
+}
+
+void TileStore::put(const OcTreeKey& key, const std::string& data) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    pending[key] = data;
+    queue.push_back(key);
+  }
+  cond.notify_one();
+}
+
+bool TileStore::take(const OcTreeKey& key, std::string& data) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  // Not written back yet
+  std::unordered_map<OcTreeKey, std::string, OcTreeKey::KeyHash>::iterator pit = pending.find(key);
+  if (pit != pending.end()) {
+    data.swap(pit->second);
+    pending.erase(pit);
+    return true;
+  }
+
+  std::unordered_map<OcTreeKey, Slot, OcTreeKey::KeyHash>::iterator it = index.find(key);
+  if (it == index.end()) return false;
+
+  data.assign(mapped + it->second.offset, it->second.length);
+  free_slots.insert(std::make_pair(it->second.capacity, it->second.offset));
+  index.erase(it);
+  return true;
+}
+
+bool TileStore::contains(const OcTreeKey& key) {
+  std::lock_guard<std::mutex> lock(mutex);
+  return pending.count(key) || index.count(key);
+}
+
+// Grow the file and mapping to hold at least size bytes.  Called with the lock held
+bool TileStore::reserve(size_t size) {
+  if (size <= mapped_size) return true;
+
+  size_t new_size = std::max(mapped_size * 2, std::max(size, (size_t)(16 << 20)));
+  if (ftruncate(fd, new_size) != 0) return false;
+
+  if (mapped) munmap(mapped, mapped_size);
+  void *m = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (m == MAP_FAILED) {
+    mapped = NULL;
+    mapped_size = 0;
+    return false;
+  }
+  mapped = (char*)m;
+  mapped_size = new_size;
+  return true;
+}
+
+void TileStore::writeLoop() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    cond.wait(lock, [this] { return stop || !queue.empty(); });
+    if (stop) return;
+
+    OcTreeKey key = queue.front();
+    queue.pop_front();
+
+    // Taken back before it was written
+    std::unordered_map<OcTreeKey, std::string, OcTreeKey::KeyHash>::iterator pit = pending.find(key);
+    if (pit == pending.end()) continue;
+    const std::string& data = pit->second;
+
+    // Best fitting free slot, else append
+    Slot slot;
+    std::multimap<size_t, size_t>::iterator fit = free_slots.lower_bound(data.size());
+    if (fit != free_slots.end()) {
+      slot.capacity = fit->first;
+      slot.offset = fit->second;
+      free_slots.erase(fit);
+    } else {
+      if (!reserve(end + data.size())) continue;
+      slot.capacity = data.size();
+      slot.offset = end;
+      end += data.size();
+    }
+    slot.length = data.size();
+
+    memcpy(mapped + slot.offset, data.data(), data.size());
+    index[key] = slot;
+    pending.erase(pit);
+  }
+}
+
+TileCache::TileCache(OcTreeOwned *tree, unsigned int depth, const std::string& path,
+                     double max_age, size_t max_resident)
+  : tree(tree), depth(depth), max_age(max_age), max_resident(max_resident), store(path) {
+}
+
+// Most occupied value and whether all of it is own, over the leaves under node
+static void blockValue(OcTreeOwned *tree, const OcTreeNodeOwned *node, float& max_log_odds,
+                       bool& own) {
+  if (!tree->nodeHasChildren(node)) {
+    max_log_odds = std::max(max_log_odds, node->getLogOdds());
+    own = own && node->isOwn();
+    return;
+  }
+  for (unsigned int i = 0; i < 8; i++)
+    if (tree->nodeChildExists(node, i))
+      blockValue(tree, tree->getNodeChild(node, i), max_log_odds, own);
+}
+
+uint64_t TileCache::mortonCode(const OcTreeKey& key) const {
+  // Key bits interleaved from the top, so every block is a range of codes
+  uint64_t code = 0;
+  for (int b = tree->getTreeDepth() - 1; b >= 0; b--)
+    for (unsigned int i = 0; i < 3; i++)
+      code = (code << 1) | ((key[i] >> b) & 1);
+  return code;
+}
+
+void TileCache::use(const OcTreeKey& tile, double now) {
+  std::unordered_map<OcTreeKey, Entry, OcTreeKey::KeyHash>::iterator it = entries.find(tile);
+  if (it != entries.end()) {
+    lru.erase(it->second.lru_pos);
+  } else {
+    load(tile);
+    it = entries.insert(std::make_pair(tile, Entry())).first;
+  }
+  lru.push_front(tile);
+  it->second.lru_pos = lru.begin();
+  it->second.last_used = now;
+}
+
+void TileCache::touch(const OcTreeKey& key, unsigned int key_depth, double now) {
+  if (key_depth >= depth) {
+    use(tree->adjustKeyAtDepth(key, depth), now);
+    return;
+  }
+
+  // A block coarser than a tile: fault in every evicted tile below it
+  unsigned int levels = tree->getTreeDepth() - key_depth;
+  key_type mask = (levels >= 16) ? 0 : (key_type)(0xffff << levels);
+  OcTreeKey base(key[0] & mask, key[1] & mask, key[2] & mask);
+  uint64_t first = mortonCode(base);
+  uint64_t last = first + ((uint64_t)1 << (3 * levels)) - 1;
+  std::vector<OcTreeKey> below;
+  for (std::map<uint64_t, OcTreeKey>::iterator it = evicted.lower_bound(first);
+       it != evicted.end() && it->first <= last; ++it)
+    below.push_back(it->second);
+  for (size_t i = 0; i < below.size(); i++) use(below[i], now);
+}
+
+void TileCache::load(const OcTreeKey& tile) {
+  evicted.erase(mortonCode(tile));
+  std::string data;
+  if (!store.take(tile, data)) return;
+
+  // The placeholder goes, the stored tile takes its place
+  OcTreeNodeOwned *node = tree->search(tile, depth);
+  if (node) {
+    tree->deleteChildren(node);
+    tree->deleteNode(tile, depth);
+  }
+
+  SubtreeDag dag;
+  std::istringstream datastream(data);
+  if (dag.read(datastream)) dag.toTree(tree, tile, depth);
+}
+
+void TileCache::unload(const OcTreeKey& tile) {
+  OcTreeNodeOwned *node = tree->search(tile, depth);
+  if (!node) return;
+
+  SubtreeDag dag;
+  dag.build(*tree, node);
+  std::ostringstream datastream;
+  dag.write(datastream);
+  store.put(tile, datastream.str());
+  evicted[mortonCode(tile)] = tile;
+
+  // The tile stays as one placeholder leaf, as occupied as its most
+  // occupied voxel and own only if all of it is, so the published map
+  // keeps it at a fraction of the size.  Space it left unknown shows as
+  // that block value until the tile is loaded again
+  float max_log_odds = -std::numeric_limits<float>::max();
+  bool own = true;
+  blockValue(tree, node, max_log_odds, own);
+  tree->deleteChildren(node);
+  node->setLogOdds(max_log_odds);
+  node->setOwn(own);
+  tree->markDirty(tile);
+}
+
+void TileCache::evict(double now) {
+  if (!store.isOpen()) return;
+
+  // Pick up tiles that were created without going through touch()
+  for (OcTreeOwned::tree_iterator it = tree->begin_tree(depth), end = tree->end_tree();
+       it != end; ++it) {
+    if (it.getDepth() == depth && !entries.count(it.getKey()) && !store.contains(it.getKey())) {
+      Entry e;
+      lru.push_front(it.getKey());
+      e.lru_pos = lru.begin();
+      e.last_used = now;
+      entries[it.getKey()] = e;
+    }
+  }
+
+  // Least recently used tiles sit at the back
+  while (!lru.empty()) {
+    OcTreeKey tile = lru.back();
+    Entry& e = entries[tile];
+    if (now - e.last_used <= max_age && entries.size() <= max_resident) break;
+
+    unload(tile);
+    entries.erase(tile);
+    lru.pop_back();
+  }
+}
@@ -0,0 +1,133 @@
+#include <work_pool.h>
+#include <algorithm>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Worker index of the calling thread in the pool it belongs to
+static thread_local const WorkPool *current_pool = NULL;
+static thread_local int current_worker = -1;
+
+WorkPool::WorkPool(unsigned int num_threads, const std::vector<int>& cpus, int nice)
+  : next(0), queued(0), unfinished(0), stop(false) {
+  if (num_threads == 0) num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+  for (unsigned int i = 0; i < num_threads; i++)
+    queues.push_back(new Queue);
+  for (unsigned int i = 0; i < num_threads; i++) {
+    int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+    threads.push_back(std::thread(&WorkPool::workLoop, this, i, cpu, nice));
+  }
+}
+
+WorkPool::~WorkPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  work_cond.notify_all();
+  for (size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+  for (size_t i = 0; i < queues.size(); i++)
+    delete queues[i];
+}
+
+void WorkPool::submit(const Task& task) {
+  unsigned int target;
+  if (current_pool == this) {
+    target = current_worker;
+  } else {
+    std::lock_guard<std::mutex> lock(mutex);
+    target = next++ % queues.size();
+  }
+
+  unfinished++;
+  {
+    std::lock_guard<std::mutex> lock(queues[target]->mutex);
+    queues[target]->tasks.push_back(task);
+  }
+  queued++;
+
+  // Taking the lock orders this against a worker that just found nothing
+  { std::lock_guard<std::mutex> lock(mutex); }
+  work_cond.notify_one();
+}
+
+void WorkPool::wait() {
+  int self = (current_pool == this) ? current_worker : -1;
+  while (unfinished > 0) {
+    Task task;
+    if (pop(self, task)) {
+      run(task);
+    } else {
+      // What is left is running on the workers
+      std::unique_lock<std::mutex> lock(mutex);
+      done_cond.wait(lock, [this]() { return unfinished == 0; });
+    }
+  }
+}
+
+bool WorkPool::pop(int self, Task& task) {
+  if (queued == 0) return false;
+
+  if (self >= 0) {
+    Queue *own = queues[self];
+    std::lock_guard<std::mutex> lock(own->mutex);
+    if (!own->tasks.empty()) {
+      task.swap(own->tasks.back());
+      own->tasks.pop_back();
+      queued--;
+      return true;
+    }
+  }
+
+  // Steal the oldest task, which for a split diff tends to be the largest
+  unsigned int n = queues.size();
+  unsigned int start = (self >= 0) ? self + 1 : 0;
+  for (unsigned int i = 0; i < n; i++) {
+    Queue *victim = queues[(start + i) % n];
+    std::lock_guard<std::mutex> lock(victim->mutex);
+    if (!victim->tasks.empty()) {
+      task.swap(victim->tasks.front());
+      victim->tasks.pop_front();
+      queued--;
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkPool::run(Task& task) {
+  task();
+  if (--unfinished == 0) {
+    { std::lock_guard<std::mutex> lock(mutex); }
+    done_cond.notify_all();
+  }
+}
+
+void WorkPool::workLoop(unsigned int self, int cpu, int nice) {
+  current_pool = this;
+  current_worker = self;
+
+  if (cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+  if (nice != 0) setpriority(PRIO_PROCESS, syscall(SYS_gettid), nice);
+
+  while (true) {
+    Task task;
+    if (pop(self, task)) {
+      run(task);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    work_cond.wait(lock, [this]() { return stop || queued > 0; });
+    if (stop) return;
+  }
+}
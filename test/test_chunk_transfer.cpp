@@ -0,0 +1,225 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <random>
+#include "chunk_transfer.h"
+
+static std::vector<uint8_t> randomPayload(std::mt19937& rng, size_t size) {
+  std::vector<uint8_t> payload(size);
+  for (size_t i = 0; i < size; i++) payload[i] = rng() & 0xff;
+  return payload;
+}
+
+// Carries chunks from a sender to a reassembler over a lossy link, and
+// requests back to the sender, keeping what completed by payload id
+struct Transfer {
+  Transfer(double loss_rate, size_t max_payloads, size_t max_bytes)
+    : sender(100, max_payloads), link(loss_rate, 1), reassembler(max_payloads, max_bytes),
+      now(0) {}
+
+  void send(uint32_t id, uint32_t index) {
+    Chunk chunk;
+    if (!sender.chunk(id, index, chunk) || link.drop()) return;
+    deliver(chunk);
+  }
+
+  void deliver(const Chunk& chunk) {
+    std::vector<uint8_t> payload;
+    if (reassembler.add("a", chunk, now, payload)) received[chunk.payload_id] = payload;
+  }
+
+  uint32_t add(const std::vector<uint8_t>& payload) {
+    uint32_t id = sender.add(payload);
+    for (uint32_t c = 0; c < sender.numChunks(id); c++) send(id, c);
+    return id;
+  }
+
+  // Answer requests for missing chunks until none are left
+  void resend(int rounds) {
+    for (int r = 0; r < rounds; r++) {
+      now += 10;
+      std::vector<ChunkReassembler::Gaps> gaps;
+      reassembler.missing(now, 5, gaps);
+      for (size_t g = 0; g < gaps.size(); g++) {
+        ASSERT_EQ(sender.epoch(), gaps[g].epoch);
+        uint32_t num_chunks = sender.numChunks(gaps[g].payload_id);
+        for (size_t i = 0; i < gaps[g].ranges.size(); i++)
+          for (uint32_t c = gaps[g].ranges[i].first;
+               c <= gaps[g].ranges[i].second && c < num_chunks; c++)
+            send(gaps[g].payload_id, c);
+      }
+    }
+  }
+
+  ChunkSender sender;
+  LossyLink link;
+  ChunkReassembler reassembler;
+  double now;
+  std::map<uint32_t, std::vector<uint8_t>> received;
+};
+
+TEST(ChunkTransfer, LossIsRepairedByRequests) {
+  std::mt19937 rng(3);
+  Transfer t(0.3, 16, 1 << 20);
+  std::vector<std::vector<uint8_t>> sent;
+  for (int i = 0; i < 12; i++) {
+    sent.push_back(randomPayload(rng, rng() % 2000));
+    t.add(sent.back());
+  }
+  // Only a later payload shows that one was lost whole
+  t.link = LossyLink(0);
+  sent.push_back(randomPayload(rng, 10));
+  t.add(sent.back());
+  t.link = LossyLink(0.3, 2);
+  t.resend(30);
+
+  ASSERT_EQ(sent.size(), t.received.size());
+  for (size_t i = 0; i < sent.size(); i++) EXPECT_EQ(sent[i], t.received[i]);
+  EXPECT_EQ(0u, t.reassembler.numPartial());
+  EXPECT_EQ(0u, t.reassembler.bufferedBytes());
+}
+
+TEST(ChunkTransfer, PayloadLostWholeIsRequested) {
+  std::mt19937 rng(4);
+  Transfer t(0, 16, 1 << 20);
+  std::vector<uint8_t> first = randomPayload(rng, 500), lost = randomPayload(rng, 700);
+  t.add(first);
+  t.link = LossyLink(1);
+  uint32_t lost_id = t.add(lost);
+  t.link = LossyLink(0);
+  t.add(randomPayload(rng, 300));
+  EXPECT_EQ(0u, t.received.count(lost_id));
+
+  t.now += 10;
+  std::vector<ChunkReassembler::Gaps> gaps;
+  t.reassembler.missing(t.now, 5, gaps);
+  ASSERT_EQ(1u, gaps.size());
+  EXPECT_EQ(lost_id, gaps[0].payload_id);
+  ASSERT_EQ(1u, gaps[0].ranges.size());
+  EXPECT_EQ(0u, gaps[0].ranges[0].first);
+  for (uint32_t c = 0; c < t.sender.numChunks(lost_id); c++) t.send(lost_id, c);
+  EXPECT_EQ(lost, t.received[lost_id]);
+
+  // Unanswered, a payload of unknown size is given up after one request
+  t.link = LossyLink(1);
+  t.add(randomPayload(rng, 100));
+  t.link = LossyLink(0);
+  t.add(randomPayload(rng, 100));
+  t.link = LossyLink(1);
+  t.resend(1);
+  EXPECT_EQ(1u, t.reassembler.numPartial());
+  t.resend(1);
+  EXPECT_EQ(0u, t.reassembler.numPartial());
+}
+
+TEST(ChunkTransfer, ReorderedChunksComplete) {
+  std::mt19937 rng(5);
+  ChunkSender sender(64, 8);
+  ChunkReassembler reassembler(8, 1 << 20);
+  std::vector<std::vector<uint8_t>> sent;
+  std::vector<Chunk> chunks;
+  for (int i = 0; i < 5; i++) {
+    sent.push_back(randomPayload(rng, 100 + rng() % 1000));
+    uint32_t id = sender.add(sent.back());
+    for (uint32_t c = 0; c < sender.numChunks(id); c++) {
+      chunks.push_back(Chunk());
+      ASSERT_TRUE(sender.chunk(id, c, chunks.back()));
+    }
+  }
+  std::shuffle(chunks.begin(), chunks.end(), rng);
+
+  std::map<uint32_t, std::vector<uint8_t>> received;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    std::vector<uint8_t> payload;
+    if (reassembler.add("a", chunks[i], 0, payload)) received[chunks[i].payload_id] = payload;
+  }
+  ASSERT_EQ(sent.size(), received.size());
+  for (size_t i = 0; i < sent.size(); i++) EXPECT_EQ(sent[i], received[i]);
+  EXPECT_EQ(0u, reassembler.numPartial());
+}
+
+TEST(ChunkTransfer, CorruptChunkShowsUpAsGap) {
+  std::mt19937 rng(6);
+  ChunkSender sender(100, 4);
+  ChunkReassembler reassembler(4, 1 << 20);
+  std::vector<uint8_t> sent = randomPayload(rng, 450), payload;
+  uint32_t id = sender.add(sent);
+  for (uint32_t c = 0; c < sender.numChunks(id); c++) {
+    Chunk chunk;
+    sender.chunk(id, c, chunk);
+    if (c == 2) chunk.data[7] ^= 0x10;
+    EXPECT_FALSE(reassembler.add("a", chunk, 0, payload));
+  }
+
+  std::vector<ChunkReassembler::Gaps> gaps;
+  reassembler.missing(10, 5, gaps);
+  ASSERT_EQ(1u, gaps.size());
+  ASSERT_EQ(1u, gaps[0].ranges.size());
+  EXPECT_EQ(std::make_pair(2u, 2u), gaps[0].ranges[0]);
+
+  Chunk chunk;
+  sender.chunk(id, 2, chunk);
+  ASSERT_TRUE(reassembler.add("a", chunk, 10, payload));
+  EXPECT_EQ(sent, payload);
+}
+
+TEST(ChunkTransfer, NewEpochIsKeptApart) {
+  std::mt19937 rng(7);
+  ChunkSender before(100, 4), after(100, 4);
+  ASSERT_NE(before.epoch(), after.epoch());
+  ChunkReassembler reassembler(4, 1 << 20);
+  std::vector<uint8_t> old_payload = randomPayload(rng, 300), new_payload = randomPayload(rng, 300);
+  // Both senders use id 0; the restarted one must not complete the old payload
+  uint32_t old_id = before.add(old_payload), new_id = after.add(new_payload);
+  ASSERT_EQ(old_id, new_id);
+
+  std::vector<uint8_t> payload;
+  Chunk chunk;
+  before.chunk(old_id, 0, chunk);
+  EXPECT_FALSE(reassembler.add("a", chunk, 0, payload));
+  for (uint32_t c = 0; c < after.numChunks(new_id); c++) {
+    after.chunk(new_id, c, chunk);
+    reassembler.add("a", chunk, 0, payload);
+  }
+  EXPECT_EQ(new_payload, payload);
+
+  // The old epoch's partial cannot be resent any more, so it is dropped
+  std::vector<ChunkReassembler::Gaps> gaps;
+  reassembler.missing(10, 5, gaps);
+  EXPECT_TRUE(gaps.empty());
+  EXPECT_EQ(0u, reassembler.numPartial());
+}
+
+TEST(ChunkTransfer, ReassemblyIsBounded) {
+  std::mt19937 rng(8);
+  ChunkSender sender(100, 16);
+  ChunkReassembler reassembler(4, 1000);
+  std::vector<uint8_t> payload;
+
+  // Too large to be buffered at all
+  uint32_t id = sender.add(randomPayload(rng, 1001));
+  Chunk chunk;
+  sender.chunk(id, 0, chunk);
+  EXPECT_FALSE(reassembler.add("a", chunk, 0, payload));
+  EXPECT_EQ(0u, reassembler.numPartial());
+
+  // Partial payloads beyond the count or byte bound push out the oldest
+  for (int i = 0; i < 10; i++) {
+    id = sender.add(randomPayload(rng, 400));
+    sender.chunk(id, 0, chunk);
+    EXPECT_FALSE(reassembler.add("a", chunk, i + 1, payload));
+    EXPECT_LE(reassembler.numPartial(), 4u);
+    EXPECT_LE(reassembler.bufferedBytes(), 1000u);
+  }
+
+  // A chunk claiming more chunks than bytes is rejected before allocating
+  chunk.num_chunks = chunk.payload_size + 1;
+  chunk.crc = chunkCrc(chunk);
+  size_t buffered = reassembler.bufferedBytes();
+  EXPECT_FALSE(reassembler.add("b", chunk, 20, payload));
+  EXPECT_EQ(buffered, reassembler.bufferedBytes());
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,162 @@
+#include <gtest/gtest.h>
+#include <random>
+#include "map_merger.h"
+
+static const double RES = 0.1;
+
+static OcTreeKey voxel(int x, int y, int z) {
+  return OcTreeKey(32768 + x, 32768 + y, 32768 + z);
+}
+
+static OcTreeKey rootKey(const OcTreeOwned& tree) {
+  key_type center = 1 << (tree.getTreeDepth() - 1);
+  return OcTreeKey(center, center, center);
+}
+
+// Own voxels and earlier neighbor voxels the diffs are merged into
+static void fillBase(OcTreeOwned *tree) {
+  for (int x = 0; x < 4; x++)
+    for (int y = 0; y < 8; y++) {
+      tree->mergeNode(voxel(x, y, 0), 16, 2.0f, true, false, 0);
+      tree->mergeNode(voxel(x + 4, y, 1), 16, -1.0f, false, true, 9);
+    }
+  tree->pruneDirty();
+}
+
+// Random diffs over a small region, some holding coarse blocks
+static OcTree* randomDiff(std::mt19937& rng) {
+  std::uniform_int_distribution<int> coord(0, 7), value(-3, 3), coin(0, 3);
+  OcTree *diff = new OcTree(RES);
+  for (int v = 0; v < 40; v++)
+    diff->setNodeValue(voxel(coord(rng), coord(rng), coord(rng)), 0.25f + value(rng));
+  if (coin(rng) == 0) {
+    float lo = 0.25f + value(rng);
+    for (int x = 0; x < 4; x++)
+      for (int y = 0; y < 4; y++)
+        for (int z = 0; z < 4; z++)
+          diff->setNodeValue(voxel(4 + x, y, 4 + z), lo);
+  }
+  diff->prune();
+  return diff;
+}
+
+static void expectSame(OcTreeOwned *a, OcTreeOwned *b, int size) {
+  for (int x = 0; x < size; x++)
+    for (int y = 0; y < size; y++)
+      for (int z = 0; z < size; z++) {
+        OcTreeNodeOwned *na = a->search(voxel(x, y, z));
+        OcTreeNodeOwned *nb = b->search(voxel(x, y, z));
+        ASSERT_EQ(na == NULL, nb == NULL) << x << " " << y << " " << z;
+        if (!na) continue;
+        EXPECT_EQ(na->getLogOdds(), nb->getLogOdds()) << x << " " << y << " " << z;
+        EXPECT_EQ(na->isOwn(), nb->isOwn()) << x << " " << y << " " << z;
+      }
+}
+
+TEST(MapMerger, PairwiseStampedEqualsSequentialMerge) {
+  std::mt19937 rng(11);
+  for (int round = 0; round < 10; round++) {
+    std::vector<OcTree*> diffs;
+    std::vector<bool> overwrite;
+    for (int i = 0; i < 7; i++) {
+      diffs.push_back(randomDiff(rng));
+      overwrite.push_back(rng() & 1);
+    }
+
+    OcTreeOwned sequential(RES), reduced(RES);
+    fillBase(&sequential);
+    fillBase(&reduced);
+    for (size_t i = 0; i < diffs.size(); i++)
+      merge_maps(&sequential, diffs[i], false, overwrite[i], (uint8_t)(i + 1));
+    sequential.pruneDirty();
+
+    // As the neighbor stage reduces a batch: stamp, combine pairwise, merge
+    std::vector<OcTreeOwned*> stamped;
+    for (size_t i = 0; i < diffs.size(); i++) {
+      stamped.push_back(new OcTreeOwned(RES));
+      merge_maps(stamped[i], diffs[i], overwrite[i], false, (uint8_t)(i + 1));
+      stamped[i]->pruneDirty();
+    }
+    for (size_t step = 1; step < stamped.size(); step *= 2) {
+      for (size_t i = 0; i + step < stamped.size(); i += 2 * step) {
+        combine_stamped(stamped[i], stamped[i + step]);
+        delete stamped[i + step];
+        stamped[i + step] = NULL;
+      }
+    }
+    merge_stamped(&reduced, stamped[0], stamped[0]->getRoot(), rootKey(*stamped[0]), 0);
+    reduced.pruneDirty();
+
+    expectSame(&sequential, &reduced, 8);
+    delete stamped[0];
+    for (size_t i = 0; i < diffs.size(); i++) delete diffs[i];
+  }
+}
+
+TEST(MapMerger, DiffTreeHoldsExactlyTheChangedLeaves) {
+  std::mt19937 rng(12);
+  std::uniform_int_distribution<int> coord(0, 7), value(-3, 3), coin(0, 2);
+  OcTreeOwned sent(RES);
+  OcTree current(RES);
+  for (int v = 0; v < 300; v++) {
+    OcTreeKey key = voxel(coord(rng), coord(rng), coord(rng));
+    float lo = 0.25f + value(rng);
+    current.setNodeValue(key, lo);
+    // Most voxels were sent before, a third of them with another value
+    int c = coin(rng);
+    if (c == 1) sent.mergeNode(key, 16, lo, true, false, 0);
+    else if (c == 2) sent.mergeNode(key, 16, lo + 1.0f, true, false, 0);
+  }
+  sent.pruneDirty();
+  current.prune();
+
+  OcTreeOwned diff(RES);
+  double num_changed = 0;
+  double num_new = build_diff_tree(&sent, &current, &diff, 0, &num_changed);
+
+  // Expanded, the diff holds each voxel of the current map that is new or
+  // changed, with its current value, and nothing else
+  double expect_new = 0, expect_changed = 0;
+  for (int x = 0; x < 8; x++)
+    for (int y = 0; y < 8; y++)
+      for (int z = 0; z < 8; z++) {
+        OcTreeNode *now = current.search(voxel(x, y, z));
+        OcTreeNodeOwned *before = sent.search(voxel(x, y, z));
+        OcTreeNodeOwned *emitted = diff.search(voxel(x, y, z));
+        bool changed = now && (!before || before->getLogOdds() != now->getLogOdds());
+        ASSERT_EQ(changed, emitted != NULL) << x << " " << y << " " << z;
+        if (changed) EXPECT_EQ(now->getLogOdds(), emitted->getLogOdds());
+        if (now && !before) expect_new++;
+        if (changed) expect_changed++;
+      }
+  EXPECT_EQ(expect_new, num_new);
+  EXPECT_EQ(expect_changed, num_changed);
+}
+
+TEST(MapMerger, DiffTreeSkipsMovesInsideTheHysteresisBand) {
+  OcTreeOwned sent(RES);
+  OcTree current(RES);
+  OcTreeKey small = voxel(0, 0, 0), large = voxel(1, 0, 0), flip = voxel(2, 0, 0);
+  sent.mergeNode(small, 16, 0.8f, true, false, 0);
+  sent.mergeNode(large, 16, 0.8f, true, false, 0);
+  sent.mergeNode(flip, 16, 0.2f, true, false, 0);
+  sent.pruneDirty();
+  // Still occupied and moved less than thresh; moved more; turned free
+  current.setNodeValue(small, 1.2f);
+  current.setNodeValue(large, 2.0f);
+  current.setNodeValue(flip, -0.2f);
+
+  OcTreeOwned diff(RES);
+  build_diff_tree(&sent, &current, &diff, 0.5);
+  EXPECT_TRUE(diff.search(small) == NULL);
+  ASSERT_TRUE(diff.search(large) != NULL);
+  EXPECT_EQ(2.0f, diff.search(large)->getLogOdds());
+  ASSERT_TRUE(diff.search(flip) != NULL);
+  EXPECT_EQ(-0.2f, diff.search(flip)->getLogOdds());
+  EXPECT_EQ(2u, diff.getNumLeafNodes());
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
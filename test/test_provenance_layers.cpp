@@ -0,0 +1,129 @@
+#include <gtest/gtest.h>
+#include <random>
+#include "map_merger.h"
+#include "provenance_layers.h"
+
+static const double RES = 0.1;
+
+struct Write {
+  std::string owner;
+  uint8_t id;
+  bool overwrite;
+  OcTree *diff;
+};
+
+static OcTreeKey voxel(int x, int y, int z) {
+  return OcTreeKey(32768 + x, 32768 + y, 32768 + z);
+}
+
+// Merge the writes in order with merge_maps, and through the layers
+static void mergeBoth(const std::vector<Write>& writes, OcTreeOwned *merged,
+                      OcTreeOwned *composite) {
+  ProvenanceLayers layers(RES, "self");
+  for (size_t i = 0; i < writes.size(); i++) {
+    merge_maps(merged, writes[i].diff, false, writes[i].overwrite, writes[i].id);
+    layers.insert(writes[i].owner, writes[i].id, writes[i].diff, writes[i].overwrite, true);
+  }
+  layers.refresh(composite);
+}
+
+static void expectSame(OcTreeOwned *merged, OcTreeOwned *composite, int size) {
+  for (int x = 0; x < size; x++)
+    for (int y = 0; y < size; y++)
+      for (int z = 0; z < size; z++) {
+        OcTreeNodeOwned *a = merged->search(voxel(x, y, z));
+        OcTreeNodeOwned *b = composite->search(voxel(x, y, z));
+        ASSERT_EQ(a == NULL, b == NULL) << x << " " << y << " " << z;
+        if (a) EXPECT_EQ(a->getLogOdds(), b->getLogOdds()) << x << " " << y << " " << z;
+      }
+}
+
+static OcTree* diffOf(const OcTreeKey& k1, float lo1, const OcTreeKey& k2, float lo2) {
+  OcTree *diff = new OcTree(RES);
+  diff->setNodeValue(k1, lo1);
+  diff->setNodeValue(k2, lo2);
+  return diff;
+}
+
+TEST(ProvenanceLayers, LateNonOverwriteKeepsEarlierValue) {
+  OcTreeKey x0 = voxel(0, 0, 0), x1 = voxel(1, 0, 0);
+  std::vector<Write> writes;
+  // a's voxel x1 comes from a write that could overwrite, x0 from one that
+  // could not, with b's earlier value in between; a's last write may not
+  // replace either
+  Write w1 = {"a", 1, true, diffOf(x1, -1.5f, x1, -1.5f)};
+  Write w2 = {"a", 1, false, diffOf(x0, 0.5f, x0, 0.5f)};
+  Write w3 = {"b", 2, false, diffOf(x0, 1.5f, x0, 1.5f)};
+  Write w4 = {"a", 1, false, diffOf(x0, 2.5f, x1, 2.5f)};
+  writes.push_back(w1);
+  writes.push_back(w2);
+  writes.push_back(w3);
+  writes.push_back(w4);
+
+  OcTreeOwned merged(RES), composite(RES);
+  mergeBoth(writes, &merged, &composite);
+  EXPECT_EQ(0.5f, merged.search(x0)->getLogOdds());
+  EXPECT_EQ(-1.5f, merged.search(x1)->getLogOdds());
+  expectSame(&merged, &composite, 2);
+  for (size_t i = 0; i < writes.size(); i++) delete writes[i].diff;
+}
+
+TEST(ProvenanceLayers, EraseKeepsLaterWrites) {
+  OcTreeKey x0 = voxel(0, 0, 0), x1 = voxel(1, 0, 0);
+  OcTree *first = diffOf(x0, 0.5f, x1, 0.5f);
+  OcTree *later = diffOf(x0, 1.5f, x0, 1.5f);
+  ProvenanceLayers layers(RES, "self");
+  unsigned int first_stamp = layers.insert("a", 1, first, true);
+  unsigned int later_stamp = layers.insert("a", 1, later, true);
+
+  // Erasing the first diff leaves the voxel the later one rewrote
+  layers.erase("a", first, first_stamp);
+  EXPECT_EQ(1.5f, layers.layer("a")->search(x0)->getLogOdds());
+  EXPECT_TRUE(layers.layer("a")->search(x1) == NULL);
+
+  // Erasing the later one and restoring the first brings its value back
+  layers.restore("a", 1, first, first_stamp);
+  EXPECT_EQ(1.5f, layers.layer("a")->search(x0)->getLogOdds());
+  layers.erase("a", later, later_stamp);
+  EXPECT_TRUE(layers.layer("a")->search(x0) == NULL);
+  layers.restore("a", 1, first, first_stamp);
+  EXPECT_EQ(0.5f, layers.layer("a")->search(x0)->getLogOdds());
+  EXPECT_EQ(0.5f, layers.layer("a")->search(x1)->getLogOdds());
+  delete first;
+  delete later;
+}
+
+TEST(ProvenanceLayers, RefreshMatchesMergeMaps) {
+  std::mt19937 rng(7);
+  std::uniform_int_distribution<int> coord(0, 7), value(-3, 3), owner(0, 2), coin(0, 1);
+  const char *owners[] = {"a", "b", "c"};
+  std::vector<Write> writes;
+  for (int i = 0; i < 40; i++) {
+    OcTree *diff = new OcTree(RES);
+    for (int v = 0; v < 30; v++) {
+      // Some diffs hold coarse blocks that later ones write into
+      float lo = 0.25f + value(rng);
+      diff->setNodeValue(voxel(coord(rng), coord(rng), coord(rng)), lo);
+      if (coin(rng) && v == 0) {
+        OcTreeKey base = voxel(coord(rng) & ~1, coord(rng) & ~1, coord(rng) & ~1);
+        for (int j = 0; j < 8; j++)
+          diff->setNodeValue(OcTreeKey(base[0] + (j & 1), base[1] + ((j >> 1) & 1),
+                                       base[2] + ((j >> 2) & 1)), lo);
+      }
+    }
+    diff->prune();
+    int o = owner(rng);
+    Write w = {owners[o], (uint8_t)(o + 1), coin(rng) == 1, diff};
+    writes.push_back(w);
+  }
+
+  OcTreeOwned merged(RES), composite(RES);
+  mergeBoth(writes, &merged, &composite);
+  expectSame(&merged, &composite, 8);
+  for (size_t i = 0; i < writes.size(); i++) delete writes[i].diff;
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,111 @@
+#include <gtest/gtest.h>
+#include <random>
+#include <sstream>
+#include "subtree_dag.h"
+
+static const double RES = 0.1;
+
+static OcTreeKey voxel(int x, int y, int z) {
+  return OcTreeKey(32768 + x, 32768 + y, 32768 + z);
+}
+
+// Every leaf of a covers the same voxels with the same value and own flag in b
+static void expectSameLeaves(OcTreeOwned& a, OcTreeOwned& b) {
+  size_t num_leaves = 0;
+  for (OcTreeOwned::leaf_iterator it = a.begin_leafs(); it != a.end_leafs(); ++it) {
+    OcTreeNodeOwned *node = b.search(it.getKey(), it.getDepth());
+    ASSERT_TRUE(node != NULL);
+    EXPECT_FALSE(b.nodeHasChildren(node));
+    EXPECT_EQ(it->getLogOdds(), node->getLogOdds());
+    EXPECT_EQ(it->isOwn(), node->isOwn());
+    num_leaves++;
+  }
+  EXPECT_EQ(num_leaves, b.getNumLeafNodes());
+}
+
+static void roundTrip(const SubtreeDag& dag, OcTreeOwned *tree) {
+  std::stringstream stream;
+  dag.write(stream);
+  SubtreeDag copy;
+  ASSERT_TRUE(copy.read(stream));
+  EXPECT_EQ(dag.numNodes(), copy.numNodes());
+  copy.toTree(tree);
+}
+
+TEST(SubtreeDag, RoundTripKeepsLeaves) {
+  std::mt19937 rng(1);
+  std::uniform_int_distribution<int> coord(-40, 40), value(-2, 3);
+  OcTreeOwned tree(RES);
+  for (int i = 0; i < 3000; i++) {
+    OcTreeNodeOwned *node =
+        tree.setNodeValue(voxel(coord(rng), coord(rng), coord(rng)), 0.5f * value(rng));
+    node->setOwn(i % 3 == 0);
+  }
+  tree.prune();
+
+  SubtreeDag dag;
+  dag.build(tree);
+  OcTreeOwned copy(RES);
+  roundTrip(dag, &copy);
+  expectSameLeaves(tree, copy);
+  expectSameLeaves(copy, tree);
+}
+
+TEST(SubtreeDag, IdenticalSubtreesAreShared) {
+  // One 8^3 pattern repeated in 64 aligned blocks
+  OcTreeOwned tree(RES);
+  for (int b = 0; b < 64; b++)
+    for (int x = 0; x < 8; x++)
+      for (int y = 0; y < 8; y++)
+        for (int z = 0; z < 8; z++)
+          if ((x + y + z) % 3 == 0)
+            tree.setNodeValue(voxel(8 * (b & 3) + x, 8 * ((b >> 2) & 3) + y, 8 * (b >> 4) + z),
+                              (x == y) ? 1.0f : -1.0f);
+
+  SubtreeDag dag;
+  dag.build(tree);
+  // The pattern is stored once, plus the path above the blocks
+  EXPECT_LT(dag.numNodes(), tree.size() / 32);
+
+  OcTreeOwned copy(RES);
+  roundTrip(dag, &copy);
+  expectSameLeaves(tree, copy);
+}
+
+// A stream holding a chain of inner nodes above one leaf
+static std::string chainStream(unsigned int levels) {
+  std::string s("ODAG");
+  double resolution = RES;
+  s.append((const char*)&resolution, sizeof(resolution));
+  float value = 1.0f;
+  s += (char)1;
+  s.append((const char*)&value, sizeof(value));
+  s += (char)(levels + 1);
+  s += (char)(levels + 1);
+  s += (char)0;
+  s += (char)0;
+  for (unsigned int i = 0; i < levels; i++) {
+    s += (char)0;
+    s += (char)1;
+    s += (char)1;
+  }
+  return s;
+}
+
+TEST(SubtreeDag, RejectsStreamsDeeperThanTheTree) {
+  SubtreeDag dag;
+  std::stringstream fits(chainStream(16));
+  ASSERT_TRUE(dag.read(fits));
+  OcTreeOwned tree(RES);
+  dag.toTree(&tree);
+  EXPECT_EQ(1u, tree.getNumLeafNodes());
+
+  std::stringstream too_deep(chainStream(17));
+  EXPECT_FALSE(dag.read(too_deep));
+  EXPECT_TRUE(dag.empty());
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}